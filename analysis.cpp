@@ -0,0 +1,1038 @@
+#include <cmath>
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <stdexcept>
+#include <essentia/algorithmfactory.h>
+#include <essentia/essentiamath.h>
+#include <essentia/streaming/algorithms/vectoroutput.h>
+#include <essentia/scheduler/network.h>
+#include "analysis.h"
+#include "hpcp_kernel.h"
+
+using namespace std;
+
+#define HPCP_SIZE 12
+
+const char *const analysis_stage_names[ANALYSIS_STAGE_COUNT] = {"decode", "rhythm", "key", "hpcp", "chords"};
+
+static thread_local analysis_stats_t *current_stats = nullptr;
+
+void analysis_set_stats(analysis_stats_t *stats)
+{
+    current_stats = stats;
+}
+
+analysis_stats_t *analysis_get_stats()
+{
+    return current_stats;
+}
+
+void analysis_note_bytes(int stage, uint64_t bytes)
+{
+    if (current_stats)
+    {
+        uint64_t peak = current_stats->peak_bytes[stage];
+        while (bytes > peak && !current_stats->peak_bytes[stage].compare_exchange_weak(peak, bytes))
+        {
+        }
+    }
+}
+
+string analysis_stats_json(const analysis_stats_t &stats)
+{
+    ostringstream out;
+    out << "{\"stages\":{";
+    for (int s = 0; s < ANALYSIS_STAGE_COUNT; s++)
+    {
+        out << (s ? "," : "") << "\"" << analysis_stage_names[s] << "\":{\"wall\":" << stats.wall_us[s] / 1e6
+            << ",\"runs\":" << stats.runs[s] << ",\"peak_bytes\":" << stats.peak_bytes[s] << "}";
+    }
+    out << "},\"decoded_samples\":" << stats.decoded_samples
+        << ",\"hpcp_frames_done\":" << stats.hpcp_frames_done
+        << ",\"hpcp_frames_expected\":" << stats.hpcp_frames_expected
+        << ",\"errors\":" << stats.errors << "}";
+    return out.str();
+}
+
+void analysis_decode_file(const char *path, const cancel_token_t &cancelled, vector<essentia::Real> &audio, const function<void()> &on_chunk)
+{
+    analysis_stage_timer_t timer(ANALYSIS_STAGE_DECODE);
+    essentia::streaming::Algorithm *loader = essentia::streaming::AlgorithmFactory::create("MonoLoader", "filename", path, "sampleRate", 44100);
+    loader->output("audio") >> audio;
+
+    essentia::scheduler::Network network(loader);
+    network.runPrepare();
+    while (network.runStep())
+    {
+        check_cancelled(cancelled);
+        if (current_stats)
+        {
+            current_stats->decoded_samples = audio.size();
+        }
+        if (on_chunk)
+        {
+            on_chunk();
+        }
+    }
+    analysis_note_bytes(ANALYSIS_STAGE_DECODE, audio.capacity() * sizeof(essentia::Real));
+}
+
+// Essentia's key names, as ChordsDetection spells the chord roots
+static const char *const chord_roots[12] = {"A", "Bb", "B", "C", "C#", "D", "Eb", "E", "F", "F#", "G", "Ab"};
+static const char *const chord_root_aliases[12] = {"A", "A#", "Cb", "B#", "Db", "D", "D#", "Fb", "E#", "Gb", "G", "G#"};
+
+static const vector<string> &chord_vocabulary()
+{
+    static const vector<string> names = []()
+    {
+        vector<string> result(1, "N");
+        for (const char *root : chord_roots)
+        {
+            result.push_back(root);
+        }
+        for (const char *root : chord_roots)
+        {
+            result.push_back(string(root) + "m");
+        }
+        return result;
+    }();
+    return names;
+}
+
+chord_id_t chord_intern(const string &name)
+{
+    bool is_minor = name.size() > 1 && name.back() == 'm';
+    string root = is_minor ? name.substr(0, name.size() - 1) : name;
+    for (int i = 0; i < 12; i++)
+    {
+        if (root == chord_roots[i] || root == chord_root_aliases[i])
+        {
+            return 1 + i + (is_minor ? 12 : 0);
+        }
+    }
+    return 0;
+}
+
+const string &chord_name(chord_id_t id)
+{
+    const vector<string> &names = chord_vocabulary();
+    return names[id < names.size() ? id : 0];
+}
+
+// Every analysis thread keeps its configured algorithm instances, as building
+// them is costly (RhythmExtractor2013 and KeyExtractor set up whole internal
+// networks). An instance is reset and reused while the parameters it was
+// created with stay the same, and rebuilt when they change.
+struct algorithm_slot_t
+{
+    essentia::standard::Algorithm *algorithm = nullptr;
+    string settings;
+
+    ~algorithm_slot_t()
+    {
+        delete algorithm;
+    }
+};
+
+struct algorithm_pool_t
+{
+    algorithm_slot_t frameCutter;
+    algorithm_slot_t window;
+    algorithm_slot_t spectrum;
+    algorithm_slot_t peaks;
+    algorithm_slot_t hpcp;
+    algorithm_slot_t chordsDetection;
+    algorithm_slot_t chordsDetectionBeats;
+    algorithm_slot_t rhythm;
+    algorithm_slot_t keyExtractor;
+    algorithm_slot_t keyFromHpcp;
+    unique_ptr<hpcp_kernel_t> kernel;
+};
+
+static thread_local algorithm_pool_t pool;
+
+template <typename F>
+static essentia::standard::Algorithm *pooled(algorithm_slot_t &slot, const string &settings, F create)
+{
+    if (slot.algorithm && slot.settings == settings)
+    {
+        slot.algorithm->reset();
+        return slot.algorithm;
+    }
+    delete slot.algorithm;
+    slot.algorithm = nullptr;
+    slot.algorithm = create();
+    slot.settings = settings;
+    return slot.algorithm;
+}
+
+// after a failed compute the instance state is unknown, build it again next time
+static void drop(algorithm_slot_t &slot)
+{
+    delete slot.algorithm;
+    slot.algorithm = nullptr;
+}
+
+#define HPCP_BLOCK_FRAMES HPCP_KERNEL_BLOCK
+
+// consecutive frames, starting with frame number first
+struct hpcp_block_t
+{
+    size_t first = 0;
+    size_t count = 0;
+    vector<essentia::Real> frames[HPCP_BLOCK_FRAMES];
+};
+
+// Windowing -> Spectrum -> SpectralPeaks -> HPCP for a block of frames, on
+// the calling thread's pooled instances, or the native kernel with
+// chords_native_hpcp. Every frame is computed independently, so results
+// don't depend on which thread computed them.
+struct hpcp_frontend_t
+{
+    hpcp_kernel_t *kernel = nullptr;
+    essentia::standard::Algorithm *window;
+    essentia::standard::Algorithm *spectrum;
+    essentia::standard::Algorithm *peaks;
+    essentia::standard::Algorithm *hpcp;
+    vector<essentia::Real> windowed, spec, freqs, mags, hpcpOut;
+
+    explicit hpcp_frontend_t(const plugin_config_t &config)
+    {
+        if (config.chords_native_hpcp)
+        {
+            if (!pool.kernel || pool.kernel->frame_size != config.chords_frame_size)
+            {
+                pool.kernel.reset();
+                pool.kernel.reset(new hpcp_kernel_t(config.chords_frame_size));
+            }
+            kernel = pool.kernel.get();
+            return;
+        }
+
+        essentia::standard::AlgorithmFactory &factory = essentia::standard::AlgorithmFactory::instance();
+
+        window = pooled(pool.window, "", []()
+                        { return essentia::standard::AlgorithmFactory::create("Windowing", "type", "blackmanharris92"); }); // option(?)
+        window->output("frame").set(windowed);
+
+        spectrum = pooled(pool.spectrum, "", []()
+                          { return essentia::standard::AlgorithmFactory::create("Spectrum"); });
+        spectrum->output("spectrum").set(spec);
+
+        peaks = pooled(pool.peaks, "", []()
+                       { return essentia::standard::AlgorithmFactory::create("SpectralPeaks"); });
+        peaks->output("frequencies").set(freqs);
+        peaks->output("magnitudes").set(mags);
+
+        // keep in sync with hpcp_kernel.cpp
+        hpcp = pooled(pool.hpcp, "", [&]()
+                      { return factory.create(
+                            "HPCP",
+                            "size", HPCP_SIZE, // should be 12 ?
+                            "harmonics", 4,    // 4~8 ?
+                            "weightType", "squaredCosine",
+                            "bandPreset", true,
+                            "normalized", "unitMax", // unitSum ?
+                            "nonLinear", true); });
+        hpcp->output("hpcp").set(hpcpOut);
+    }
+
+    hpcp_frontend_t(const hpcp_frontend_t &) = delete;
+    hpcp_frontend_t &operator=(const hpcp_frontend_t &) = delete;
+
+    // writes block.count rows of HPCP_SIZE values to out
+    void compute(const hpcp_block_t &block, essentia::Real *out)
+    {
+        if (block.count == 0)
+        {
+            return;
+        }
+        if (kernel)
+        {
+            kernel->compute(block.frames, block.count, out);
+            return;
+        }
+        for (size_t i = 0; i < block.count; i++)
+        {
+            window->input("frame").set(block.frames[i]);
+            window->compute();
+
+            spectrum->input("frame").set(windowed);
+            spectrum->compute();
+
+            peaks->input("spectrum").set(spec);
+            peaks->compute();
+
+            hpcp->input("frequencies").set(freqs);
+            hpcp->input("magnitudes").set(mags);
+            hpcp->compute();
+
+            copy(hpcpOut.begin(), hpcpOut.end(), out + i * HPCP_SIZE);
+        }
+    }
+};
+
+static void drop_hpcp_frontend()
+{
+    pool.kernel.reset();
+    drop(pool.window);
+    drop(pool.spectrum);
+    drop(pool.peaks);
+    drop(pool.hpcp);
+}
+
+// upper bound of the frames FrameCutter cuts from samples: frames start at
+// most frameSize before the signal and stop once they start past its end
+static size_t max_frame_count(size_t samples, const plugin_config_t &config)
+{
+    return (samples + config.chords_frame_size) / config.chords_hop_size + 2;
+}
+
+// cuts up to HPCP_BLOCK_FRAMES frames into block, false once there are no more
+static bool cut_block(essentia::standard::Algorithm *frameCutter, const vector<essentia::Real> &frame, size_t first, size_t rows, const cancel_token_t &cancelled, hpcp_block_t &block)
+{
+    block.first = first;
+    block.count = 0;
+    while (block.count < HPCP_BLOCK_FRAMES)
+    {
+        check_cancelled(cancelled);
+        frameCutter->compute();
+        if (frame.empty())
+        {
+            return false;
+        }
+        if (first + block.count == rows)
+        {
+            throw runtime_error("more frames than expected");
+        }
+        block.frames[block.count++] = frame;
+    }
+    return true;
+}
+
+// hpcpFrames is sized to max_frame_count() rows and trimmed to the frames cut
+static void compute_hpcp_serial(essentia::standard::Algorithm *frameCutter, const vector<essentia::Real> &frame, const plugin_config_t &config, const cancel_token_t &cancelled, vector<essentia::Real> &hpcpFrames)
+{
+    hpcp_frontend_t frontend(config);
+    hpcp_block_t block;
+    size_t rows = hpcpFrames.size() / HPCP_SIZE;
+    size_t frames = 0;
+    bool is_more = true;
+    while (is_more)
+    {
+        is_more = cut_block(frameCutter, frame, frames, rows, cancelled, block);
+        frontend.compute(block, hpcpFrames.data() + frames * HPCP_SIZE);
+        frames += block.count;
+        if (current_stats)
+        {
+            current_stats->hpcp_frames_done += block.count;
+        }
+    }
+    hpcpFrames.resize(frames * HPCP_SIZE);
+}
+
+// Threads for compute_hpcp_parallel(), started on first use and kept until
+// the library is unloaded, so the algorithms each of them pools are built
+// once rather than for every track. Tasks run in submission order; the pool
+// only grows, to the largest thread count asked for. The threads keep the
+// priority of whichever job started them.
+struct hpcp_thread_pool_t
+{
+    std::mutex mutex;
+    condition_variable wakeup;
+    deque<function<void()>> tasks;
+    vector<thread> threads;
+    bool is_stopping = false;
+
+    void run(int count, const function<void()> &task)
+    {
+        {
+            lock_guard<std::mutex> lock(mutex);
+            while ((int)threads.size() < count)
+            {
+                threads.emplace_back([this]()
+                                     { work(); });
+            }
+            for (int i = 0; i < count; i++)
+            {
+                tasks.push_back(task);
+            }
+        }
+        wakeup.notify_all();
+    }
+
+    void work()
+    {
+        while (true)
+        {
+            function<void()> task;
+            {
+                unique_lock<std::mutex> lock(mutex);
+                wakeup.wait(lock, [&]()
+                            { return !tasks.empty() || is_stopping; });
+                if (tasks.empty())
+                {
+                    return;
+                }
+                task = move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    ~hpcp_thread_pool_t()
+    {
+        {
+            lock_guard<std::mutex> lock(mutex);
+            is_stopping = true;
+        }
+        wakeup.notify_all();
+        for (thread &t : threads)
+        {
+            t.join();
+        }
+    }
+};
+
+static hpcp_thread_pool_t hpcp_threads;
+
+// Same result as compute_hpcp_serial(): the calling thread runs the only
+// FrameCutter and hands blocks of consecutive frames to threads workers on
+// hpcp_threads, which write each frame's HPCP to its own row of hpcpFrames.
+// Those threads don't take the caller's scheduling priority, so callers that
+// run at a lowered one (the plugin's background jobs) must use
+// chords_threads = 1 and never get here.
+static void compute_hpcp_parallel(essentia::standard::Algorithm *frameCutter, const vector<essentia::Real> &frame, const plugin_config_t &config, int threads, const cancel_token_t &cancelled, vector<essentia::Real> &hpcpFrames)
+{
+    std::mutex mutex;
+    condition_variable filled_ready, free_ready, workers_done;
+    vector<hpcp_block_t> blocks(threads * 2);
+    deque<hpcp_block_t *> filled, free_blocks;
+    for (hpcp_block_t &block : blocks)
+    {
+        free_blocks.push_back(&block);
+    }
+    bool is_done = false;
+    int workers_running = threads; // the locals here outlive every worker
+    exception_ptr error;
+    analysis_stats_t *stats = current_stats;
+
+    auto worker = [&]()
+    {
+        try
+        {
+            hpcp_frontend_t frontend(config);
+            while (true)
+            {
+                hpcp_block_t *block;
+                {
+                    unique_lock<std::mutex> lock(mutex);
+                    filled_ready.wait(lock, [&]()
+                                      { return !filled.empty() || is_done || error; });
+                    if (filled.empty() || error)
+                    {
+                        break;
+                    }
+                    block = filled.front();
+                    filled.pop_front();
+                }
+                frontend.compute(*block, hpcpFrames.data() + block->first * HPCP_SIZE);
+                if (stats)
+                {
+                    stats->hpcp_frames_done += block->count;
+                }
+                {
+                    lock_guard<std::mutex> lock(mutex);
+                    free_blocks.push_back(block);
+                }
+                free_ready.notify_one();
+            }
+        }
+        catch (...)
+        {
+            {
+                lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                {
+                    error = current_exception();
+                }
+            }
+            filled_ready.notify_all();
+            free_ready.notify_all();
+        }
+        // notified under the lock: once it is released the caller may return
+        lock_guard<std::mutex> lock(mutex);
+        workers_running--;
+        workers_done.notify_all();
+    };
+    hpcp_threads.run(threads, worker);
+
+    size_t frames = 0;
+    size_t rows = hpcpFrames.size() / HPCP_SIZE;
+    bool is_last = false;
+    try
+    {
+        while (!is_last)
+        {
+            hpcp_block_t *block;
+            {
+                unique_lock<std::mutex> lock(mutex);
+                free_ready.wait(lock, [&]()
+                                { return !free_blocks.empty() || error; });
+                if (error)
+                {
+                    break;
+                }
+                block = free_blocks.front();
+                free_blocks.pop_front();
+            }
+
+            is_last = !cut_block(frameCutter, frame, frames, rows, cancelled, *block);
+            frames += block->count;
+
+            {
+                lock_guard<std::mutex> lock(mutex);
+                filled.push_back(block);
+            }
+            filled_ready.notify_one();
+        }
+    }
+    catch (...)
+    {
+        lock_guard<std::mutex> lock(mutex);
+        if (!error)
+        {
+            error = current_exception();
+        }
+    }
+
+    {
+        lock_guard<std::mutex> lock(mutex);
+        is_done = true;
+    }
+    filled_ready.notify_all();
+    {
+        unique_lock<std::mutex> lock(mutex);
+        workers_done.wait(lock, [&]()
+                          { return workers_running == 0; });
+    }
+    if (error)
+    {
+        rethrow_exception(error);
+    }
+    hpcpFrames.resize(frames * HPCP_SIZE);
+}
+
+static int chords_thread_count(const plugin_config_t &config)
+{
+    if (config.chords_threads > 0)
+    {
+        return config.chords_threads;
+    }
+    return max(1u, thread::hardware_concurrency());
+}
+
+void analyze_hpcp(const vector<essentia::Real> &audio, const plugin_config_t &config, const cancel_token_t &cancelled, vector<essentia::Real> &hpcpFrames)
+{
+    analysis_stage_timer_t timer(ANALYSIS_STAGE_HPCP);
+    try
+    {
+        essentia::standard::Algorithm *frameCutter = pooled(pool.frameCutter, to_string(config.chords_frame_size) + " " + to_string(config.chords_hop_size), [&]()
+                                                            { return essentia::standard::AlgorithmFactory::create("FrameCutter", "frameSize", config.chords_frame_size, "hopSize", config.chords_hop_size); });
+        std::vector<essentia::Real> frame;
+        frameCutter->input("signal").set(audio);
+        frameCutter->output("frame").set(frame);
+
+        // allocated once for the whole track
+        size_t rows = max_frame_count(audio.size(), config);
+        hpcpFrames.assign(rows * HPCP_SIZE, 0.0f);
+        analysis_note_bytes(ANALYSIS_STAGE_HPCP, hpcpFrames.size() * sizeof(essentia::Real));
+        if (current_stats)
+        {
+            // summed over every HPCP run of the track, the rows that weren't
+            // needed are taken back below
+            current_stats->hpcp_frames_expected += rows;
+        }
+
+        // short tracks aren't worth the threads
+        int threads = min<size_t>(chords_thread_count(config), rows / (HPCP_BLOCK_FRAMES * 4));
+        if (threads > 1)
+        {
+            compute_hpcp_parallel(frameCutter, frame, config, threads, cancelled, hpcpFrames);
+        }
+        else
+        {
+            compute_hpcp_serial(frameCutter, frame, config, cancelled, hpcpFrames);
+        }
+        if (current_stats)
+        {
+            current_stats->hpcp_frames_expected -= rows - hpcpFrames.size() / HPCP_SIZE;
+        }
+    }
+    catch (analysis_cancelled &)
+    {
+        throw;
+    }
+    catch (...)
+    {
+        drop(pool.frameCutter);
+        drop_hpcp_frontend();
+        throw;
+    }
+}
+
+void analyze_chords_from_hpcp(const vector<essentia::Real> &hpcpFrames, const vector<float> &ticks, const plugin_config_t &config, const cancel_token_t &cancelled, chordsResult &result)
+{
+    analysis_stage_timer_t timer(ANALYSIS_STAGE_CHORDS);
+    try
+    {
+        vector<string> chordName;
+        vector<essentia::Real> chordStrength;
+
+        essentia::standard::Algorithm *chordsDetection;
+        if (ticks.size() != 0)
+        {
+            chordsDetection = pooled(pool.chordsDetectionBeats, config.ChordsDetection_chromaPick + " " + to_string(config.chords_hop_size), [&]()
+                                     { return essentia::standard::AlgorithmFactory::create("ChordsDetectionBeats",
+                                                                                           "chromaPick", config.ChordsDetection_chromaPick,
+                                                                                           "hopSize", config.chords_hop_size); });
+            chordsDetection->input("ticks").set(ticks);
+            result.is_follow_the_rhythm = true;
+        }
+        else
+        {
+            chordsDetection = pooled(pool.chordsDetection, to_string(config.ChordsDetection_windowSize) + " " + to_string(config.chords_hop_size), [&]()
+                                     { return essentia::standard::AlgorithmFactory::create("ChordsDetection", "windowSize", config.ChordsDetection_windowSize,
+                                                                                           "hopSize", config.chords_hop_size); });
+            result.delay = config.chords_hop_size / 44100.0;
+            result.is_follow_the_rhythm = false;
+        }
+        // ChordsDetection only takes one vector per frame
+        size_t frames = hpcpFrames.size() / HPCP_SIZE;
+        std::vector<std::vector<essentia::Real>> allHPCPs(frames);
+        for (size_t i = 0; i < frames; i++)
+        {
+            allHPCPs[i].assign(hpcpFrames.begin() + i * HPCP_SIZE, hpcpFrames.begin() + (i + 1) * HPCP_SIZE);
+        }
+        chordsDetection->input("pcp").set(allHPCPs);
+        chordsDetection->output("chords").set(chordName);
+        chordsDetection->output("strength").set(chordStrength);
+
+        chordsDetection->compute();
+        check_cancelled(cancelled);
+
+        result.success = true;
+        result.chords.resize(chordName.size());
+        result.strength.resize(chordStrength.size());
+        for (size_t i = 0; i < chordName.size(); i++)
+        {
+            result.chords[i] = chord_intern(chordName[i]);
+        }
+        for (size_t i = 0; i < chordStrength.size(); i++)
+        {
+            result.strength[i] = chord_strength_quantize(chordStrength[i]);
+        }
+    }
+    catch (analysis_cancelled &)
+    {
+        throw;
+    }
+    catch (...)
+    {
+        drop(pool.chordsDetection);
+        drop(pool.chordsDetectionBeats);
+        throw;
+    }
+}
+
+void analyze_chords(const vector<essentia::Real> &audio, const vector<float> &ticks, const plugin_config_t &config, const cancel_token_t &cancelled, chordsResult &result)
+{
+    std::vector<essentia::Real> hpcpFrames;
+    analyze_hpcp(audio, config, cancelled, hpcpFrames);
+    analyze_chords_from_hpcp(hpcpFrames, ticks, config, cancelled, result);
+}
+
+// Key on the track's mean chroma, the way KeyExtractor concludes, but from the
+// chord frames instead of a second spectral pass
+void analyze_key_from_hpcp(const vector<essentia::Real> &hpcpFrames, const cancel_token_t &cancelled, keyResult &result)
+{
+    analysis_stage_timer_t timer(ANALYSIS_STAGE_KEY);
+    try
+    {
+        size_t frames = hpcpFrames.size() / HPCP_SIZE;
+        if (frames == 0)
+        {
+            throw runtime_error("no audio frames");
+        }
+        vector<double> sum(HPCP_SIZE, 0.0);
+        for (size_t i = 0; i < frames; i++)
+        {
+            for (int k = 0; k < HPCP_SIZE; k++)
+            {
+                sum[k] += hpcpFrames[i * HPCP_SIZE + k];
+            }
+        }
+        vector<essentia::Real> mean(HPCP_SIZE);
+        for (int k = 0; k < HPCP_SIZE; k++)
+        {
+            mean[k] = sum[k] / frames;
+        }
+
+        essentia::standard::Algorithm *keyDetection = pooled(pool.keyFromHpcp, "", []()
+                                                             { return essentia::standard::AlgorithmFactory::create("Key", "profileType", "bgate"); }); // KeyExtractor's profile
+        string key, scale;
+        essentia::Real strength, firstToSecond;
+        keyDetection->input("pcp").set(mean);
+        keyDetection->output("key").set(key);
+        keyDetection->output("scale").set(scale);
+        keyDetection->output("strength").set(strength);
+        keyDetection->output("firstToSecondRelativeStrength").set(firstToSecond);
+        keyDetection->compute();
+        check_cancelled(cancelled);
+
+        result.success = true;
+        result.key = key;
+        result.scale = scale;
+        result.strength = strength;
+    }
+    catch (analysis_cancelled &)
+    {
+        throw;
+    }
+    catch (...)
+    {
+        drop(pool.keyFromHpcp);
+        throw;
+    }
+}
+
+void analyze_key_chords(const vector<essentia::Real> &audio, const vector<float> &ticks, const plugin_config_t &config, const cancel_token_t &cancelled, keyResult &key, chordsResult &chords)
+{
+    std::vector<essentia::Real> hpcpFrames;
+    analyze_hpcp(audio, config, cancelled, hpcpFrames);
+    analyze_key_from_hpcp(hpcpFrames, cancelled, key);
+    analyze_chords_from_hpcp(hpcpFrames, ticks, config, cancelled, chords);
+}
+
+void analyze_key(const vector<essentia::Real> &audio, const plugin_config_t &config, const cancel_token_t &cancelled, keyResult &result)
+{
+    analysis_stage_timer_t timer(ANALYSIS_STAGE_KEY);
+    analysis_note_bytes(ANALYSIS_STAGE_KEY, audio.size() * sizeof(essentia::Real));
+    try
+    {
+        essentia::standard::AlgorithmFactory &factory = essentia::standard::AlgorithmFactory::instance();
+        essentia::standard::Algorithm *keyExtractor = pooled(pool.keyExtractor, "", [&]()
+                                                             { return factory.create("KeyExtractor"); });
+
+        string key, scale;
+        essentia::Real strength;
+
+        keyExtractor->input("audio").set(audio);
+        keyExtractor->output("key").set(key);
+        keyExtractor->output("scale").set(scale);
+        keyExtractor->output("strength").set(strength);
+
+        keyExtractor->compute();
+        check_cancelled(cancelled);
+
+        result.success = true;
+        result.key = key;
+        result.scale = scale;
+        result.strength = strength;
+    }
+    catch (analysis_cancelled &)
+    {
+        throw;
+    }
+    catch (...)
+    {
+        drop(pool.keyExtractor);
+        throw;
+    }
+}
+
+void analyze_bpm(const vector<essentia::Real> &audio, float offset, const plugin_config_t &config, const cancel_token_t &cancelled, bpmResult &result)
+{
+    analysis_stage_timer_t timer(ANALYSIS_STAGE_RHYTHM);
+    analysis_note_bytes(ANALYSIS_STAGE_RHYTHM, audio.size() * sizeof(essentia::Real));
+    try
+    {
+        essentia::standard::AlgorithmFactory &factory = essentia::standard::AlgorithmFactory::instance();
+        essentia::standard::Algorithm *rhythm = pooled(pool.rhythm, config.RhythmExtractor2013_method, [&]()
+                                                       { return factory.create("RhythmExtractor2013", "method", config.RhythmExtractor2013_method); });
+
+        essentia::Real bpmValue, confidence;
+        vector<essentia::Real> ticks, estimates, bpmIntervals;
+
+        rhythm->input("signal").set(audio);
+        rhythm->output("bpm").set(bpmValue);
+        rhythm->output("ticks").set(ticks);
+        rhythm->output("confidence").set(confidence);
+        rhythm->output("estimates").set(estimates);
+        rhythm->output("bpmIntervals").set(bpmIntervals);
+
+        rhythm->compute();
+        check_cancelled(cancelled);
+
+        for (essentia::Real &tick : ticks)
+        {
+            tick += offset;
+        }
+
+        result.config = config;
+        result.success = true;
+        result.bpm = trunc(bpmValue);
+        result.confidence = (float)confidence;
+        result.bpmIntervals = (vector<float>)bpmIntervals;
+        result.estimates = (vector<float>)estimates;
+        result.ticks = (vector<float>)ticks;
+    }
+    catch (analysis_cancelled &)
+    {
+        throw;
+    }
+    catch (...)
+    {
+        drop(pool.rhythm);
+        throw;
+    }
+}
+
+// Beats of a signal too long to hold at once, tracked in overlapping windows.
+// Each window is handed to analyze_bpm() as soon as it is decoded and only
+// the overlap is kept for the next one. The seam between two windows lies in
+// the middle of their overlap, ticks before it come from the earlier window.
+// The tempo is taken from the merged ticks, as RhythmExtractor2013 does.
+#define BPM_WINDOW_MIN_SECONDS 60
+#define BPM_WINDOW_OVERLAP_SECONDS 10
+
+int analysis_median_bpm(const vector<float> &intervals)
+{
+    vector<float> sorted = intervals;
+    nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    return trunc(60.0f / sorted[sorted.size() / 2]);
+}
+
+struct bpm_windows_t
+{
+    const plugin_config_t &config;
+    const cancel_token_t &cancelled;
+    size_t window_samples;
+    size_t overlap_samples = BPM_WINDOW_OVERLAP_SECONDS * 44100;
+    size_t start = 0; // of audio[0] within the track, in samples
+    vector<float> ticks;
+    vector<float> estimates;
+    double confidence = 0.0;
+    size_t windows = 0;
+
+    bpm_windows_t(const plugin_config_t &config, const cancel_token_t &cancelled) : config(config), cancelled(cancelled)
+    {
+        // RhythmExtractor2013 needs a few times its input on top of it
+        window_samples = max<size_t>((size_t)config.memory_limit_mb * 1048576 / sizeof(essentia::Real) / 4, BPM_WINDOW_MIN_SECONDS * 44100);
+    }
+
+    void analyze(const vector<essentia::Real> &window)
+    {
+        bpmResult part;
+        analyze_bpm(window, start / 44100.0f, config, cancelled, part);
+        float seam = (start + overlap_samples / 2) / 44100.0f;
+        if (windows > 0)
+        {
+            ticks.erase(lower_bound(ticks.begin(), ticks.end(), seam), ticks.end());
+        }
+        for (float tick : part.ticks)
+        {
+            if (windows == 0 || tick >= seam)
+            {
+                ticks.push_back(tick);
+            }
+        }
+        estimates.insert(estimates.end(), part.estimates.begin(), part.estimates.end());
+        confidence += part.confidence;
+        windows++;
+    }
+
+    // called while audio grows, analyzes and drops every complete window
+    void consume(vector<essentia::Real> &audio)
+    {
+        while (audio.size() >= window_samples)
+        {
+            vector<essentia::Real> window(audio.begin(), audio.begin() + window_samples);
+            analyze(window);
+            size_t advance = window_samples - overlap_samples;
+            audio.erase(audio.begin(), audio.begin() + advance);
+            start += advance;
+        }
+    }
+
+    void finish(vector<essentia::Real> &audio, bpmResult &result)
+    {
+        if (windows == 0 || audio.size() > overlap_samples)
+        {
+            analyze(audio);
+        }
+        audio = vector<essentia::Real>();
+
+        vector<float> intervals;
+        for (size_t i = 1; i < ticks.size(); i++)
+        {
+            intervals.push_back(ticks[i] - ticks[i - 1]);
+        }
+        if (intervals.empty())
+        {
+            throw runtime_error("no beats found");
+        }
+        result.config = config;
+        result.success = true;
+        result.bpm = analysis_median_bpm(intervals);
+        result.confidence = confidence / windows;
+        result.bpmIntervals = intervals;
+        result.estimates = estimates;
+        result.ticks = ticks;
+    }
+};
+
+// One Essentia streaming network per track. The loader feeds the chord front
+// end (FrameCutter -> Windowing -> Spectrum -> SpectralPeaks -> HPCP) and
+// KeyExtractor while it decodes, so their memory follows the buffer sizes
+// rather than the track length and decoding overlaps with the features. Only
+// the 12 chroma values per frame are kept, moved after every step into one
+// flat buffer sized from duration, plus the signal itself when the beats are
+// needed, as RhythmExtractor2013 works on the whole track; with a memory limit
+// only a window of it, see bpm_windows_t.
+void analyze_streaming(const char *path, double duration, const plugin_config_t &config, const vector<float> &ticks, const cancel_token_t &cancelled, bpmResult &bpm, keyResult &key, chordsResult &chords)
+{
+    // with shared_spectrum_enable the key always comes from the HPCP, even
+    // when the chords aren't wanted, so it is cached under one setting
+    bool is_key_shared = config.key_enable && config.shared_spectrum_enable;
+
+    essentia::streaming::Algorithm *loader = essentia::streaming::AlgorithmFactory::create("MonoLoader", "filename", path, "sampleRate", 44100);
+    essentia::scheduler::Network network(loader);
+
+    vector<essentia::Real> audio;
+    if (config.bpm_enable)
+    {
+        loader->output("audio") >> audio;
+    }
+
+    // VectorOutput pushes one vector per frame, hpcpOut is drained into
+    // hpcpFrames between steps so only the frames of one step are held twice
+    vector<vector<essentia::Real>> hpcpOut;
+    vector<essentia::Real> hpcpFrames;
+    if (config.chords_enable || is_key_shared)
+    {
+        if (duration > 0.0)
+        {
+            hpcpFrames.reserve(max_frame_count((size_t)(duration * 44100), config) * HPCP_SIZE);
+        }
+        // keep in sync with hpcp_frontend_t
+        essentia::streaming::Algorithm *frameCutter = essentia::streaming::AlgorithmFactory::create("FrameCutter", "frameSize", config.chords_frame_size, "hopSize", config.chords_hop_size);
+        essentia::streaming::Algorithm *window = essentia::streaming::AlgorithmFactory::create("Windowing", "type", "blackmanharris92");
+        essentia::streaming::Algorithm *spectrum = essentia::streaming::AlgorithmFactory::create("Spectrum");
+        essentia::streaming::Algorithm *peaks = essentia::streaming::AlgorithmFactory::create("SpectralPeaks");
+        essentia::streaming::Algorithm *hpcp = essentia::streaming::AlgorithmFactory::create(
+            "HPCP",
+            "size", HPCP_SIZE,
+            "harmonics", 4,
+            "weightType", "squaredCosine",
+            "bandPreset", true,
+            "normalized", "unitMax",
+            "nonLinear", true);
+
+        loader->output("audio") >> frameCutter->input("signal");
+        frameCutter->output("frame") >> window->input("frame");
+        window->output("frame") >> spectrum->input("frame");
+        spectrum->output("spectrum") >> peaks->input("spectrum");
+        peaks->output("frequencies") >> hpcp->input("frequencies");
+        peaks->output("magnitudes") >> hpcp->input("magnitudes");
+        hpcp->output("hpcp") >> hpcpOut;
+    }
+
+    vector<string> keys, scales;
+    vector<essentia::Real> strengths;
+    if (config.key_enable && !is_key_shared)
+    {
+        essentia::streaming::Algorithm *keyExtractor = essentia::streaming::AlgorithmFactory::create("KeyExtractor");
+        loader->output("audio") >> keyExtractor->input("audio");
+        keyExtractor->output("key") >> keys;
+        keyExtractor->output("scale") >> scales;
+        keyExtractor->output("strength") >> strengths;
+    }
+
+    // VectorOutput appends to audio, it may be trimmed between steps
+    bpm_windows_t windows(config, cancelled);
+    bool is_windowed = config.bpm_enable && config.memory_limit_mb > 0;
+
+    {
+        // decoding, the HPCP chain and the key extractor share the pass, windowed
+        // rhythm extraction is also counted under rhythm
+        analysis_stage_timer_t timer(ANALYSIS_STAGE_DECODE);
+        auto drain_hpcp = [&]()
+        {
+            for (const vector<essentia::Real> &frame : hpcpOut)
+            {
+                hpcpFrames.insert(hpcpFrames.end(), frame.begin(), frame.end());
+            }
+            if (current_stats)
+            {
+                current_stats->hpcp_frames_done += hpcpOut.size();
+            }
+            hpcpOut.clear();
+        };
+        network.runPrepare();
+        while (network.runStep())
+        {
+            check_cancelled(cancelled);
+            drain_hpcp();
+            if (current_stats)
+            {
+                current_stats->decoded_samples = windows.start + audio.size();
+            }
+            if (is_windowed)
+            {
+                windows.consume(audio);
+            }
+        }
+        drain_hpcp();
+        hpcpOut = vector<vector<essentia::Real>>();
+    }
+
+    if (is_windowed && windows.windows > 0)
+    {
+        windows.finish(audio, bpm);
+    }
+    else if (config.bpm_enable)
+    {
+        // the track fit in one window
+        analyze_bpm(audio, 0.0f, config, cancelled, bpm);
+        audio = vector<essentia::Real>();
+    }
+    if (config.key_enable && !is_key_shared)
+    {
+        if (keys.empty() || scales.empty() || strengths.empty())
+        {
+            throw runtime_error("no key found");
+        }
+        key.success = true;
+        key.key = keys.back();
+        key.scale = scales.back();
+        key.strength = strengths.back();
+    }
+    if (config.chords_enable || is_key_shared)
+    {
+        analysis_note_bytes(ANALYSIS_STAGE_HPCP, hpcpFrames.capacity() * sizeof(essentia::Real));
+    }
+    if (is_key_shared)
+    {
+        analyze_key_from_hpcp(hpcpFrames, cancelled, key);
+    }
+    if (config.chords_enable)
+    {
+        analyze_chords_from_hpcp(hpcpFrames, config.chords_follow_the_rhythm && config.bpm_enable ? bpm.ticks : ticks, config, cancelled, chords);
+    }
+}
@@ -0,0 +1,227 @@
+// Analysis core shared by the plugin and the headless benchmark: decoding
+// and the BPM, key and chords analyzers, free of any DeaDBeeF or GTK state.
+#ifndef DDB_ANALYSIS_H
+#define DDB_ANALYSIS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <essentia/essentia.h>
+
+struct plugin_config_t
+{
+    std::string ChordsDetection_chromaPick;
+    bool chords_follow_the_rhythm;
+    float ChordsDetection_windowSize;
+    int chords_frame_size;
+    int chords_hop_size;
+    int chords_threads; // HPCP threads per track, 0 for one per core
+    bool chords_native_hpcp; // hpcp_kernel.h instead of Essentia's chain
+    bool chords_enable;
+
+    std::string RhythmExtractor2013_method;
+    bool bpm_enable;
+    int bpm_averaging;
+    float circle_attenuration_speed;
+
+    bool key_enable;
+    bool shared_spectrum_enable; // key always from the chord HPCP, see analyze_key_chords()
+
+    int update_fps;
+    int strength_length;
+    bool live_enable;
+    bool player_decoder_enable;
+    int prefetch_count;
+    int prefetch_threads;
+    bool meta_read_enable;
+    bool batch_write_tags;
+    bool progressive_enable;
+    bool streaming_engine_enable; // analyze_streaming() instead of a full decode
+    int memory_limit_mb; // longer tracks go through analyze_streaming() in windows, 0 for no limit
+    int progressive_excerpt_length;
+    bool debug_stats; // per-track statistics in the widget tooltip
+    bool segmented_enable; // provisional beats and chords from the play position outwards
+    int segment_length; // seconds
+    int background_cpu_share; // percent of the background pool a batch may use
+};
+
+struct bpmResult
+{
+    bool success = false;
+    const char *uri;
+    int bpm = 0;
+    std::vector<float> ticks;
+    std::vector<float> estimates;
+    std::vector<float> bpmIntervals;
+    float confidence = 0.0f;
+    bool is_provisional = false; // from the excerpt, the full track result follows
+    plugin_config_t config;
+    std::string error;
+};
+
+struct keyResult
+{
+    bool success = false;
+    const char *uri;
+    std::string key;
+    std::string scale;
+    float strength = 0.0f;
+    bool is_provisional = false;
+    std::string error;
+};
+
+// Chord labels interned into a fixed vocabulary, one byte per frame or beat:
+// 0 is "N" (no chord), then the major and minor triads on Essentia's 12 key
+// names. Names outside it, enharmonic spellings aside, intern to "N".
+typedef uint8_t chord_id_t;
+#define CHORD_VOCABULARY_SIZE 25
+chord_id_t chord_intern(const std::string &name);
+const std::string &chord_name(chord_id_t id);
+
+// chord strengths are correlations in [-1, 1], kept as 16-bit fixed point
+typedef int16_t chord_strength_t;
+#define CHORD_STRENGTH_SCALE 32767.0f
+
+inline chord_strength_t chord_strength_quantize(float strength)
+{
+    return (chord_strength_t)std::lround(std::max(-1.0f, std::min(1.0f, strength)) * CHORD_STRENGTH_SCALE);
+}
+
+inline float chord_strength_value(chord_strength_t strength)
+{
+    return strength / CHORD_STRENGTH_SCALE;
+}
+
+struct chordsResult
+{
+    float delay;
+    float offset = 0.0f; // time of chords[0], only segments start later
+    bool success = false;
+    bool is_follow_the_rhythm;
+    bool is_provisional = false; // from segments, the full track result follows
+    const char *uri;
+    std::vector<chord_id_t> chords;
+    std::vector<chord_strength_t> strength;
+    std::string error;
+};
+
+// set when the job's track is superseded, workers poll it and bail out
+typedef std::shared_ptr<std::atomic<bool>> cancel_token_t;
+
+struct analysis_cancelled : std::exception
+{
+    const char *what() const noexcept override
+    {
+        return "analysis cancelled";
+    }
+};
+
+inline void check_cancelled(const cancel_token_t &cancelled)
+{
+    if (cancelled->load(std::memory_order_relaxed))
+    {
+        throw analysis_cancelled();
+    }
+}
+
+// Instrumentation: wall time and peak buffer size per stage, plus progress
+// counters, collected for the analyze_*() calls of a thread once the caller
+// has set a stats object with analysis_set_stats(). Everything is atomic, so
+// the UI may read a stats object while workers fill it in.
+enum
+{
+    ANALYSIS_STAGE_DECODE,
+    ANALYSIS_STAGE_RHYTHM,
+    ANALYSIS_STAGE_KEY,
+    ANALYSIS_STAGE_HPCP,
+    ANALYSIS_STAGE_CHORDS,
+    ANALYSIS_STAGE_COUNT
+};
+
+extern const char *const analysis_stage_names[ANALYSIS_STAGE_COUNT];
+
+struct analysis_stats_t
+{
+    std::atomic<uint64_t> wall_us[ANALYSIS_STAGE_COUNT] = {};
+    std::atomic<uint32_t> runs[ANALYSIS_STAGE_COUNT] = {};
+    std::atomic<uint64_t> peak_bytes[ANALYSIS_STAGE_COUNT] = {};
+    std::atomic<uint64_t> decoded_samples{0};
+    std::atomic<uint64_t> hpcp_frames_done{0};
+    std::atomic<uint64_t> hpcp_frames_expected{0}; // 0 when unknown (streaming)
+    std::atomic<uint32_t> errors{0};
+};
+
+// for the calling thread's analyze_*() calls, nullptr to stop collecting
+void analysis_set_stats(analysis_stats_t *stats);
+analysis_stats_t *analysis_get_stats();
+void analysis_note_bytes(int stage, uint64_t bytes);
+// one JSON object, the format of the plugin's log line and stats file
+std::string analysis_stats_json(const analysis_stats_t &stats);
+
+// adds the time until it goes out of scope to stage
+class analysis_stage_timer_t
+{
+    analysis_stats_t *stats;
+    int stage;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit analysis_stage_timer_t(int stage) : stats(analysis_get_stats()), stage(stage), start(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~analysis_stage_timer_t()
+    {
+        if (stats)
+        {
+            stats->wall_us[stage] += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+            stats->runs[stage]++;
+        }
+    }
+};
+
+// tempo of the median beat interval, robust against merged segments
+int analysis_median_bpm(const std::vector<float> &intervals);
+
+// Decodes path to mono 44.1kHz with Essentia's streaming loader. on_chunk is
+// called after every decoded chunk with audio holding what has been decoded so far.
+void analysis_decode_file(const char *path, const cancel_token_t &cancelled, std::vector<essentia::Real> &audio, const std::function<void()> &on_chunk = nullptr);
+
+// analyze_*() run one analyzer on an already decoded signal and fill in
+// result. They throw on errors and on cancellation. The Essentia algorithms
+// are kept per calling thread and reused by its next calls.
+// HPCP of every chord frame, frames x 12 row-major
+void analyze_hpcp(const std::vector<essentia::Real> &audio, const plugin_config_t &config, const cancel_token_t &cancelled, std::vector<essentia::Real> &hpcpFrames);
+void analyze_chords(const std::vector<essentia::Real> &audio, const std::vector<float> &ticks, const plugin_config_t &config, const cancel_token_t &cancelled, chordsResult &result);
+// The stages after analyze_hpcp() alone, for callers that keep the HPCP
+// frames: ChordsDetection(Beats), and the key as in analyze_key_chords().
+void analyze_chords_from_hpcp(const std::vector<essentia::Real> &hpcpFrames, const std::vector<float> &ticks, const plugin_config_t &config, const cancel_token_t &cancelled, chordsResult &result);
+void analyze_key_from_hpcp(const std::vector<essentia::Real> &hpcpFrames, const cancel_token_t &cancelled, keyResult &result);
+void analyze_key(const std::vector<essentia::Real> &audio, const plugin_config_t &config, const cancel_token_t &cancelled, keyResult &result);
+// One spectral pass for both: the key is estimated on the mean of the chord
+// HPCP frames instead of KeyExtractor's own framing, so it may differ slightly
+// from analyze_key().
+void analyze_key_chords(const std::vector<essentia::Real> &audio, const std::vector<float> &ticks, const plugin_config_t &config, const cancel_token_t &cancelled, keyResult &key, chordsResult &chords);
+// Decodes path and runs the enabled analyzers through one Essentia streaming
+// network, see analysis.cpp. Chords follow the beats it finds itself when bpm is
+// enabled, or the given ticks otherwise. Never uses the native HPCP kernel.
+// With memory_limit_mb set, the beats are tracked in windows of the signal
+// that fit the limit instead of on the whole track. duration (seconds, 0 if
+// unknown) sizes the chroma buffer up front.
+void analyze_streaming(const char *path, double duration, const plugin_config_t &config, const std::vector<float> &ticks, const cancel_token_t &cancelled, bpmResult &bpm, keyResult &key, chordsResult &chords);
+// bytes of decoded signal a track of the given length needs
+inline bool analysis_exceeds_memory_limit(const plugin_config_t &config, double seconds)
+{
+    return config.memory_limit_mb > 0 && seconds * 44100 * sizeof(essentia::Real) > config.memory_limit_mb * 1048576.0;
+}
+// ticks are shifted by offset, the start time of audio within the track
+void analyze_bpm(const std::vector<essentia::Real> &audio, float offset, const plugin_config_t &config, const cancel_token_t &cancelled, bpmResult &result);
+
+#endif
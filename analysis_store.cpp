@@ -0,0 +1,548 @@
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "analysis_store.h"
+
+using namespace std;
+
+#define STORE_MAGIC "DDBASTOR"
+#define STORE_GROWTH (1 << 20)
+
+// packed arrays of a record, in this order
+enum
+{
+    STORE_TICKS,
+    STORE_ESTIMATES,
+    STORE_CHORDS,
+    STORE_STRENGTHS,
+    STORE_ARRAYS
+};
+
+static const size_t store_element_sizes[STORE_ARRAYS] = {sizeof(float), sizeof(float), sizeof(chord_id_t), sizeof(chord_strength_t)};
+
+enum
+{
+    STORE_BPM = 1,
+    STORE_KEY,
+    STORE_CHORDS_RESULT
+};
+
+#define STORE_FOLLOW_THE_RHYTHM 1
+#define STORE_TICK_DELTAS 2 // ticks stored as beat intervals, the first from 0
+
+// host byte order, the file is meant for machines of one architecture
+struct store_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t bucket_count; // a power of two
+    uint64_t end; // records are appended here
+    uint64_t record_count;
+    uint64_t reserved[4];
+};
+
+struct store_record_t
+{
+    uint64_t next; // older record in the same bucket, 0 at the end of the chain
+    uint64_t hash;
+    uint64_t size; // with the name and the arrays, a multiple of 8
+    uint32_t kind;
+    uint32_t flags;
+    uint32_t name_length; // identity "\n" settings, right after the record
+    int32_t bpm;
+    float confidence; // of the beats, or the key strength
+    float delay; // between chords
+    char key[8];
+    char scale[8];
+    uint64_t offsets[STORE_ARRAYS]; // from the start of the file
+    uint64_t counts[STORE_ARRAYS];
+};
+
+static uint64_t align8(uint64_t size)
+{
+    return (size + 7) & ~(uint64_t)7;
+}
+
+static uint64_t fnv1a_hash(const string &data)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : data)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static string store_name(const string &identity, const string &settings)
+{
+    return identity + "\n" + settings;
+}
+
+static uint64_t *store_buckets(char *base)
+{
+    return (uint64_t *)(base + sizeof(store_header_t));
+}
+
+static uint64_t store_first_record(const store_header_t *header)
+{
+    return sizeof(store_header_t) + header->bucket_count * sizeof(uint64_t);
+}
+
+// whether the name and the arrays of a record lie within its size; the record
+// itself must be mapped. Written not to overflow on garbage from corrupt files.
+static bool is_record_consistent(const store_record_t *record, uint64_t offset)
+{
+    uint64_t size = record->size;
+    uint64_t name_end = sizeof(store_record_t) + (uint64_t)record->name_length;
+    if (size < name_end || size % 8 != 0)
+    {
+        return false;
+    }
+    for (int i = 0; i < STORE_ARRAYS; i++)
+    {
+        if (record->offsets[i] < offset || record->offsets[i] - offset < name_end || record->offsets[i] - offset > size ||
+            record->counts[i] > (size - (record->offsets[i] - offset)) / store_element_sizes[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename T>
+static void read_array(const char *base, const store_record_t *record, int array, vector<T> &values)
+{
+    const T *first = (const T *)(base + record->offsets[array]);
+    values.assign(first, first + record->counts[array]);
+}
+
+analysis_store_t::~analysis_store_t()
+{
+    close();
+}
+
+void analysis_store_t::unmap()
+{
+    if (base)
+    {
+        munmap(base, mapped);
+        base = nullptr;
+        mapped = 0;
+    }
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+void analysis_store_t::close()
+{
+    lock_guard<std::mutex> lock(mutex);
+    unmap();
+}
+
+bool analysis_store_t::open(const string &path, bool is_read_only, uint32_t buckets)
+{
+    lock_guard<std::mutex> lock(mutex);
+    unmap();
+    is_writable = !is_read_only;
+    fd = ::open(path.c_str(), is_read_only ? O_RDONLY | O_CLOEXEC : O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    // the first instance to get here creates the header
+    flock(fd, is_read_only ? LOCK_SH : LOCK_EX);
+    struct stat st;
+    store_header_t header = {};
+    bool is_valid = fstat(fd, &st) == 0;
+    if (is_valid && st.st_size == 0 && is_writable)
+    {
+        memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+        header.version = ANALYSIS_STORE_VERSION;
+        header.bucket_count = buckets;
+        header.end = store_first_record(&header);
+        is_valid = posix_fallocate(fd, 0, header.end + STORE_GROWTH) == 0 && pwrite(fd, &header, sizeof(header), 0) == sizeof(header) && fstat(fd, &st) == 0;
+    }
+    else if (is_valid)
+    {
+        is_valid = pread(fd, &header, sizeof(header), 0) == sizeof(header);
+    }
+    flock(fd, LOCK_UN);
+
+    is_valid = is_valid && memcmp(header.magic, STORE_MAGIC, sizeof(header.magic)) == 0 && header.version == ANALYSIS_STORE_VERSION &&
+               header.bucket_count > 0 && (header.bucket_count & (header.bucket_count - 1)) == 0 &&
+               (uint64_t)st.st_size >= header.end && header.end >= store_first_record(&header);
+    if (is_valid)
+    {
+        base = (char *)mmap(nullptr, st.st_size, is_writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
+        {
+            base = nullptr;
+            is_valid = false;
+        }
+        mapped = st.st_size;
+    }
+    if (!is_valid)
+    {
+        unmap();
+    }
+    return is_valid;
+}
+
+// Other instances grow the file, so a record past the mapping may still be in
+// the file: the mapping then follows the file size. Pointers into the old
+// mapping are invalid afterwards.
+bool analysis_store_t::is_mapped(uint64_t offset, uint64_t size)
+{
+    if (size <= mapped && offset <= mapped - size)
+    {
+        return true;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size > (uint64_t)st.st_size || offset > (uint64_t)st.st_size - size)
+    {
+        return false;
+    }
+    char *grown = (char *)mmap(nullptr, st.st_size, is_writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (grown == MAP_FAILED)
+    {
+        return false;
+    }
+    munmap(base, mapped);
+    base = grown;
+    mapped = st.st_size;
+    return true;
+}
+
+// The newest record of name and kind, checked to lie completely in the file.
+// Records only ever link to older ones, which lie before them, so a chain
+// that doesn't go strictly backwards is corrupt and ends the walk.
+const store_record_t *analysis_store_t::find(const string &name, int kind)
+{
+    if (!base)
+    {
+        return nullptr;
+    }
+    uint64_t first = store_first_record((store_header_t *)base);
+    uint64_t hash = fnv1a_hash(name);
+    uint32_t bucket = hash & (((store_header_t *)base)->bucket_count - 1);
+    uint64_t offset = __atomic_load_n(&store_buckets(base)[bucket], __ATOMIC_ACQUIRE);
+    uint64_t previous = UINT64_MAX;
+    while (offset != 0)
+    {
+        if (offset < first || offset % 8 != 0 || offset >= previous || !is_mapped(offset, sizeof(store_record_t)))
+        {
+            return nullptr;
+        }
+        const store_record_t *record = (const store_record_t *)(base + offset);
+        if (record->hash == hash && (int)record->kind == kind && record->name_length == name.size())
+        {
+            if (!is_mapped(offset, record->size))
+            {
+                return nullptr;
+            }
+            record = (const store_record_t *)(base + offset);
+            if (is_record_consistent(record, offset) && memcmp(record + 1, name.data(), name.size()) == 0)
+            {
+                return record;
+            }
+        }
+        previous = offset;
+        offset = record->next;
+    }
+    return nullptr;
+}
+
+// Writes the record with its name and arrays past the end under the file
+// lock, then moves the end and links the record into its bucket. A crash in
+// between leaves an unreachable record, never a reachable partial one.
+bool analysis_store_t::append(const store_record_t &record, const string &name, const void *const *arrays)
+{
+    if (!base || !is_writable)
+    {
+        return false;
+    }
+    uint64_t size = align8(sizeof(store_record_t) + name.size());
+    uint64_t array_sizes[STORE_ARRAYS];
+    for (int i = 0; i < STORE_ARRAYS; i++)
+    {
+        array_sizes[i] = record.counts[i] * store_element_sizes[i];
+        size += align8(array_sizes[i]);
+    }
+
+    flock(fd, LOCK_EX);
+    uint64_t end = __atomic_load_n(&((store_header_t *)base)->end, __ATOMIC_ACQUIRE);
+    // Writing through the mapping into a hole the disk has no room for raises
+    // SIGBUS, so the blocks are reserved first, even when the file is already
+    // big enough: it may be a sparse copy or grown by ftruncate().
+    uint64_t reserved = size;
+    if (!is_mapped(end, size))
+    {
+        uint64_t grown = max<uint64_t>(end + size + STORE_GROWTH, mapped + mapped / 2);
+        reserved = grown - end;
+    }
+    if (posix_fallocate(fd, end, reserved) != 0 || !is_mapped(end, size))
+    {
+        flock(fd, LOCK_UN);
+        return false;
+    }
+
+    store_record_t *stored = (store_record_t *)(base + end);
+    *stored = record;
+    stored->hash = fnv1a_hash(name);
+    stored->size = size;
+    stored->name_length = name.size();
+    memcpy(stored + 1, name.data(), name.size());
+    uint64_t offset = end + align8(sizeof(store_record_t) + name.size());
+    for (int i = 0; i < STORE_ARRAYS; i++)
+    {
+        stored->offsets[i] = offset;
+        if (array_sizes[i] > 0)
+        {
+            memcpy(base + offset, arrays[i], array_sizes[i]);
+        }
+        offset += align8(array_sizes[i]);
+    }
+
+    store_header_t *header = (store_header_t *)base;
+    uint64_t *bucket = &store_buckets(base)[stored->hash & (header->bucket_count - 1)];
+    stored->next = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&header->end, end + size, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header->record_count, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(bucket, end, __ATOMIC_RELEASE);
+    flock(fd, LOCK_UN);
+    return true;
+}
+
+bool analysis_store_t::load_bpm(const string &identity, const string &settings, bpmResult &result)
+{
+    lock_guard<std::mutex> lock(mutex);
+    const store_record_t *record = identity.empty() ? nullptr : find(store_name(identity, settings), STORE_BPM);
+    if (!record)
+    {
+        return false;
+    }
+    result.bpm = record->bpm;
+    result.confidence = record->confidence;
+    read_array(base, record, STORE_ESTIMATES, result.estimates);
+    if (!(record->flags & STORE_TICK_DELTAS))
+    {
+        // written before ticks were delta-encoded
+        read_array(base, record, STORE_TICKS, result.ticks);
+        result.bpmIntervals.clear();
+        for (size_t i = 1; i < result.ticks.size(); i++)
+        {
+            result.bpmIntervals.push_back(result.ticks[i] - result.ticks[i - 1]);
+        }
+        return true;
+    }
+    // the deltas are the beat intervals, the ticks their prefix sums
+    read_array(base, record, STORE_TICKS, result.bpmIntervals);
+    result.ticks.resize(result.bpmIntervals.size());
+    float tick = 0.0f;
+    for (size_t i = 0; i < result.bpmIntervals.size(); i++)
+    {
+        tick += result.bpmIntervals[i];
+        result.ticks[i] = tick;
+    }
+    if (!result.bpmIntervals.empty())
+    {
+        result.bpmIntervals.erase(result.bpmIntervals.begin());
+    }
+    return true;
+}
+
+bool analysis_store_t::load_key(const string &identity, const string &settings, keyResult &result)
+{
+    lock_guard<std::mutex> lock(mutex);
+    const store_record_t *record = identity.empty() ? nullptr : find(store_name(identity, settings), STORE_KEY);
+    if (!record)
+    {
+        return false;
+    }
+    result.key.assign(record->key, strnlen(record->key, sizeof(record->key)));
+    result.scale.assign(record->scale, strnlen(record->scale, sizeof(record->scale)));
+    result.strength = record->confidence;
+    return true;
+}
+
+bool analysis_store_t::load_chords(const string &identity, const string &settings, chordsResult &result)
+{
+    lock_guard<std::mutex> lock(mutex);
+    const store_record_t *record = identity.empty() ? nullptr : find(store_name(identity, settings), STORE_CHORDS_RESULT);
+    if (!record || record->counts[STORE_CHORDS] != record->counts[STORE_STRENGTHS])
+    {
+        return false;
+    }
+    result.delay = record->delay;
+    result.is_follow_the_rhythm = record->flags & STORE_FOLLOW_THE_RHYTHM;
+    read_array(base, record, STORE_CHORDS, result.chords);
+    read_array(base, record, STORE_STRENGTHS, result.strength);
+    for (chord_id_t &chord : result.chords)
+    {
+        // from a store written with another vocabulary
+        if (chord >= CHORD_VOCABULARY_SIZE)
+        {
+            chord = 0;
+        }
+    }
+    return true;
+}
+
+void analysis_store_t::store_bpm(const string &identity, const string &settings, const bpmResult &result)
+{
+    if (identity.empty())
+    {
+        return;
+    }
+    store_record_t record = {};
+    record.kind = STORE_BPM;
+    record.flags = STORE_TICK_DELTAS;
+    record.bpm = result.bpm;
+    record.confidence = result.confidence;
+    vector<float> deltas(result.ticks.size());
+    for (size_t i = 0; i < result.ticks.size(); i++)
+    {
+        deltas[i] = i == 0 ? result.ticks[0] : result.ticks[i] - result.ticks[i - 1];
+    }
+    record.counts[STORE_TICKS] = deltas.size();
+    record.counts[STORE_ESTIMATES] = result.estimates.size();
+    const void *arrays[STORE_ARRAYS] = {deltas.data(), result.estimates.data(), nullptr, nullptr};
+    lock_guard<std::mutex> lock(mutex);
+    append(record, store_name(identity, settings), arrays);
+}
+
+void analysis_store_t::store_key(const string &identity, const string &settings, const keyResult &result)
+{
+    store_record_t record = {};
+    if (identity.empty() || result.key.size() >= sizeof(record.key) || result.scale.size() >= sizeof(record.scale))
+    {
+        return;
+    }
+    record.kind = STORE_KEY;
+    memcpy(record.key, result.key.data(), result.key.size());
+    memcpy(record.scale, result.scale.data(), result.scale.size());
+    record.confidence = result.strength;
+    const void *arrays[STORE_ARRAYS] = {};
+    lock_guard<std::mutex> lock(mutex);
+    append(record, store_name(identity, settings), arrays);
+}
+
+void analysis_store_t::store_chords(const string &identity, const string &settings, const chordsResult &result)
+{
+    if (identity.empty())
+    {
+        return;
+    }
+    store_record_t record = {};
+    record.kind = STORE_CHORDS_RESULT;
+    record.flags = result.is_follow_the_rhythm ? STORE_FOLLOW_THE_RHYTHM : 0;
+    record.delay = result.delay;
+    record.counts[STORE_CHORDS] = result.chords.size();
+    record.counts[STORE_STRENGTHS] = result.strength.size();
+    const void *arrays[STORE_ARRAYS] = {nullptr, nullptr, result.chords.data(), result.strength.data()};
+    lock_guard<std::mutex> lock(mutex);
+    append(record, store_name(identity, settings), arrays);
+}
+
+// Appends to `to` the newest record of every key here that `to` doesn't have.
+// Walks the records in file order, a record is the newest of its key when the
+// lookup of its key finds it.
+int analysis_store_t::copy_newest(analysis_store_t &to)
+{
+    if (!base)
+    {
+        return -1;
+    }
+    int count = 0;
+    uint64_t end = __atomic_load_n(&((store_header_t *)base)->end, __ATOMIC_ACQUIRE);
+    uint64_t offset = store_first_record((store_header_t *)base);
+    while (offset < end && is_mapped(offset, sizeof(store_record_t)))
+    {
+        const store_record_t *record = (const store_record_t *)(base + offset);
+        uint64_t size = record->size;
+        if (size < sizeof(store_record_t) || size % 8 != 0 || !is_mapped(offset, size))
+        {
+            break;
+        }
+        record = (const store_record_t *)(base + offset);
+        if (!is_record_consistent(record, offset))
+        {
+            // a corrupt or truncated copy: nothing after this can be trusted
+            break;
+        }
+        string name((const char *)(record + 1), record->name_length);
+        int kind = record->kind;
+        const store_record_t *newest = find(name, kind);
+        record = (const store_record_t *)(base + offset);
+        if (newest == record && !to.find(name, kind))
+        {
+            const void *arrays[STORE_ARRAYS];
+            for (int i = 0; i < STORE_ARRAYS; i++)
+            {
+                arrays[i] = base + record->offsets[i];
+            }
+            if (!to.append(*record, name, arrays))
+            {
+                return -1;
+            }
+            count++;
+        }
+        offset += size;
+    }
+    return count;
+}
+
+int analysis_store_t::export_to(const string &path)
+{
+    lock_guard<std::mutex> lock(mutex);
+    if (!base)
+    {
+        return -1;
+    }
+    // about one record per bucket
+    uint32_t buckets = 1024;
+    while (buckets < ((store_header_t *)base)->record_count)
+    {
+        buckets *= 2;
+    }
+
+    string tmp = path + ".tmp";
+    unlink(tmp.c_str());
+    analysis_store_t out;
+    if (!out.open(tmp, false, buckets))
+    {
+        return -1;
+    }
+    int count;
+    {
+        lock_guard<std::mutex> out_lock(out.mutex);
+        count = copy_newest(out);
+    }
+    out.close();
+    if (count < 0 || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmp.c_str());
+        return -1;
+    }
+    return count;
+}
+
+int analysis_store_t::import_from(const string &path)
+{
+    analysis_store_t in;
+    if (!in.open(path, true))
+    {
+        return -1;
+    }
+    lock_guard<std::mutex> lock(mutex);
+    lock_guard<std::mutex> in_lock(in.mutex);
+    return in.copy_newest(*this);
+}
@@ -0,0 +1,71 @@
+// Library-wide result store: one memory-mapped file instead of a small cache
+// file per result, meant to be filled by batch runs over large libraries and
+// copied between machines.
+//
+// Layout: a header, a fixed table of hash buckets, then records appended one
+// after the other. A record has a fixed layout (BPM, confidence, key, scale,
+// strength, chord delay) and the offsets of its packed tick, estimate, chord
+// and strength arrays, which follow it in the file. Ticks are delta-encoded,
+// the deltas are the beat intervals. Records are keyed by file identity and
+// analyzer settings, each bucket chains its records newest first, so a
+// lookup is one hash and a short walk with nothing to parse.
+//
+// Updates only ever append. A writer takes an exclusive flock() on the file,
+// writes the record past the end, moves the end and then publishes the record
+// in its bucket with one 8-byte store; readers never lock the file and see a
+// record either completely or not at all. Several DeaDBeeF instances can share
+// one store this way, on one machine (flock over NFS is not to be relied on).
+//
+// export_to() writes a compacted copy (the newest record of each key) to hand
+// to other machines, import_from() adds the records of such a copy that are
+// missing here. The identity is path, size and mtime, so records only match
+// on machines that see the files under the same path, e.g. a shared mount.
+#ifndef DDB_ANALYSIS_STORE_H
+#define DDB_ANALYSIS_STORE_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include "analysis.h"
+
+#define ANALYSIS_STORE_VERSION 1
+#define ANALYSIS_STORE_BUCKETS (1 << 18)
+
+struct store_record_t;
+
+struct analysis_store_t
+{
+    // creates path if it doesn't exist, unless is_read_only; false if it
+    // isn't a store of this version
+    bool open(const std::string &path, bool is_read_only = false, uint32_t buckets = ANALYSIS_STORE_BUCKETS);
+    void close();
+    ~analysis_store_t();
+
+    // identity/settings as for the cache, see file_identity() and *_settings()
+    bool load_bpm(const std::string &identity, const std::string &settings, bpmResult &result);
+    bool load_key(const std::string &identity, const std::string &settings, keyResult &result);
+    bool load_chords(const std::string &identity, const std::string &settings, chordsResult &result);
+    void store_bpm(const std::string &identity, const std::string &settings, const bpmResult &result);
+    void store_key(const std::string &identity, const std::string &settings, const keyResult &result);
+    void store_chords(const std::string &identity, const std::string &settings, const chordsResult &result);
+
+    // record counts, -1 if path can't be written/read as a store
+    int export_to(const std::string &path);
+    int import_from(const std::string &path);
+
+private:
+    std::mutex mutex;
+    int fd = -1;
+    char *base = nullptr;
+    size_t mapped = 0;
+    bool is_writable = false;
+
+    // with mutex held
+    void unmap();
+    bool is_mapped(uint64_t offset, uint64_t size);
+    const store_record_t *find(const std::string &name, int kind);
+    bool append(const store_record_t &record, const std::string &name, const void *const *arrays);
+    int copy_newest(analysis_store_t &to);
+};
+
+#endif
@@ -0,0 +1,481 @@
+// Headless throughput benchmark for the analysis workers.
+//
+//   ddb_analysis_bench [-j threads] [-c chord threads] [-s bpm,key,chords] [-f] [-n] [-S] [-e] [-m MB] [-k] [file|directory]...
+//
+// Runs the same decode and analyzers as the plugin, one file per thread, and
+// prints one JSON object per file followed by a summary object on stdout.
+// Without file arguments the list is read from stdin, one path per line.
+// Directories are searched for audio files by extension; other files are
+// counted as skipped in the summary, not as failed.
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <cmath>
+#include <stdexcept>
+#include <cstring>
+#include <strings.h>
+#include <time.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <essentia/algorithmfactory.h>
+#include "../analysis.h"
+#include "../hpcp_kernel.h"
+
+using namespace std;
+
+enum
+{
+    STAGE_DECODE,
+    STAGE_BPM,
+    STAGE_KEY,
+    STAGE_CHORDS,
+    STAGE_STREAMING,
+    STAGE_COUNT
+};
+
+static const char *stage_names[STAGE_COUNT] = {"decode", "bpm", "key", "chords", "streaming"};
+
+struct stage_time_t
+{
+    double wall = 0.0;
+    double cpu = 0.0;
+};
+
+struct file_report_t
+{
+    bool success = false;
+    string error;
+    double audio_seconds = 0.0;
+    float hpcp_difference = 0.0f;
+    stage_time_t stages[STAGE_COUNT];
+};
+
+static vector<string> files;
+static mutex output_mutex;
+static stage_time_t totals[STAGE_COUNT];
+static double total_audio_seconds = 0.0;
+static int failed_count = 0;
+static int skipped_count = 0; // not audio by extension, in directories only
+static bool is_compare = false;
+static float max_hpcp_difference = 0.0f;
+
+// get_config()'s defaults for the analyzers. Deliberately different: one HPCP
+// thread per file (-c, files already run on -j threads), and everything that
+// needs the player is off (tag reading, prefetch, live tracking, the player's
+// decoder, progressive and segmented passes, the background CPU share).
+static plugin_config_t bench_config()
+{
+    plugin_config_t config;
+    config.RhythmExtractor2013_method = "degara";
+    config.ChordsDetection_chromaPick = "interbeat_median";
+    config.update_fps = 60;
+    config.strength_length = 4;
+    config.chords_frame_size = 8192;
+    config.chords_hop_size = 1024;
+    config.chords_threads = 1;
+    config.chords_native_hpcp = false;
+    config.bpm_averaging = 15;
+    config.circle_attenuration_speed = 0.75;
+    config.ChordsDetection_windowSize = 1.8;
+    config.chords_follow_the_rhythm = false;
+    config.chords_enable = true;
+    config.key_enable = true;
+    config.shared_spectrum_enable = false;
+    config.streaming_engine_enable = false;
+    config.memory_limit_mb = 0;
+    config.debug_stats = false;
+    config.background_cpu_share = 100;
+    config.segmented_enable = false;
+    config.segment_length = 30;
+    config.bpm_enable = true;
+    config.meta_read_enable = false;
+    config.batch_write_tags = false;
+    config.prefetch_count = 0;
+    config.prefetch_threads = 1;
+    config.live_enable = false;
+    config.player_decoder_enable = false;
+    config.progressive_enable = false;
+    config.progressive_excerpt_length = 30;
+    return config;
+}
+
+static double thread_cpu_seconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double wall_seconds()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// measures one stage on the calling thread; the cpu time misses HPCP worker
+// threads, see the summary's process-wide cpu for -c other than 1
+template <typename F>
+static void timed(stage_time_t &time, F run)
+{
+    double wall = wall_seconds();
+    double cpu = thread_cpu_seconds();
+    run();
+    time.wall = wall_seconds() - wall;
+    time.cpu = thread_cpu_seconds() - cpu;
+}
+
+static string json_string(const string &value)
+{
+    ostringstream out;
+    out << '"';
+    for (char c : value)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out << '\\' << c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
+        }
+        else
+        {
+            out << c;
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
+// extensions of the audio formats the decoder is used for, lower case
+static const char *const audio_extensions[] = {"mp3", "flac", "ogg", "oga", "opus", "m4a", "mp4", "aac", "wav", "aif", "aiff", "wma", "ape", "wv", "mpc", "tta", "dsf", "mka", "webm"};
+
+static bool is_audio_file(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/'))
+    {
+        return false;
+    }
+    for (const char *extension : audio_extensions)
+    {
+        if (strcasecmp(dot + 1, extension) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// files given by name are always analyzed, directories contribute their
+// audio files only (no cover art, cue sheets or logs)
+static void add_file(const string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        cerr << "cannot open " << path << "\n";
+    }
+    else if (S_ISDIR(st.st_mode))
+    {
+        nftw(path.c_str(), [](const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+             {
+                 if (typeflag == FTW_F && is_audio_file(fpath))
+                 {
+                     files.push_back(fpath);
+                 }
+                 else if (typeflag == FTW_F)
+                 {
+                     skipped_count++;
+                 }
+                 return 0; },
+             16, FTW_PHYS);
+    }
+    else
+    {
+        files.push_back(path);
+    }
+}
+
+static void analyze_file(const string &path, const plugin_config_t &config, file_report_t &report, ostringstream &results)
+{
+    cancel_token_t cancelled = make_shared<atomic<bool>>(false);
+    if (config.streaming_engine_enable)
+    {
+        // decode and all stages in one network, timed as one stage
+        bpmResult bpm;
+        keyResult key;
+        chordsResult chords;
+        timed(report.stages[STAGE_STREAMING], [&]()
+              { analyze_streaming(path.c_str(), 0.0, config, vector<float>(), cancelled, bpm, key, chords); });
+        if (config.bpm_enable)
+        {
+            results << ",\"bpm_value\":" << bpm.bpm;
+        }
+        if (config.key_enable)
+        {
+            results << ",\"key_value\":" << json_string(key.key + " " + key.scale);
+        }
+        if (config.chords_enable)
+        {
+            results << ",\"chords_count\":" << chords.chords.size();
+        }
+        report.success = true;
+        return;
+    }
+    vector<essentia::Real> audio;
+    timed(report.stages[STAGE_DECODE], [&]()
+          { analysis_decode_file(path.c_str(), cancelled, audio); });
+    report.audio_seconds = audio.size() / 44100.0;
+
+    bpmResult bpm;
+    if (config.bpm_enable)
+    {
+        timed(report.stages[STAGE_BPM], [&]()
+              { analyze_bpm(audio, 0.0f, config, cancelled, bpm); });
+        results << ",\"bpm_value\":" << bpm.bpm;
+    }
+    if (config.key_enable && config.chords_enable && config.shared_spectrum_enable)
+    {
+        // one pass for both, timed as the chords stage
+        keyResult key;
+        chordsResult chords;
+        timed(report.stages[STAGE_CHORDS], [&]()
+              { analyze_key_chords(audio, config.chords_follow_the_rhythm ? bpm.ticks : vector<float>(), config, cancelled, key, chords); });
+        results << ",\"key_value\":" << json_string(key.key + " " + key.scale) << ",\"chords_count\":" << chords.chords.size();
+    }
+    else if (config.key_enable)
+    {
+        keyResult key;
+        timed(report.stages[STAGE_KEY], [&]()
+              { analyze_key(audio, config, cancelled, key); });
+        results << ",\"key_value\":" << json_string(key.key + " " + key.scale);
+    }
+    if (config.chords_enable && !(config.key_enable && config.shared_spectrum_enable))
+    {
+        chordsResult chords;
+        timed(report.stages[STAGE_CHORDS], [&]()
+              { analyze_chords(audio, config.chords_follow_the_rhythm ? bpm.ticks : vector<float>(), config, cancelled, chords); });
+        results << ",\"chords_count\":" << chords.chords.size();
+    }
+    if (is_compare)
+    {
+        // native kernel against Essentia's chain on the same frames
+        plugin_config_t essentia_config = config, native_config = config;
+        essentia_config.chords_native_hpcp = false;
+        native_config.chords_native_hpcp = true;
+        vector<essentia::Real> expected, actual;
+        stage_time_t essentia_time, native_time;
+        timed(essentia_time, [&]()
+              { analyze_hpcp(audio, essentia_config, cancelled, expected); });
+        timed(native_time, [&]()
+              { analyze_hpcp(audio, native_config, cancelled, actual); });
+        if (expected.size() != actual.size())
+        {
+            throw runtime_error("native HPCP frame count differs");
+        }
+        float difference = 0.0f;
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+            difference = max(difference, fabs(expected[i] - actual[i]));
+        }
+        report.hpcp_difference = difference;
+        results << ",\"hpcp_max_difference\":" << difference
+                << ",\"hpcp_essentia\":{\"wall\":" << essentia_time.wall << ",\"cpu\":" << essentia_time.cpu << "}"
+                << ",\"hpcp_native\":{\"wall\":" << native_time.wall << ",\"cpu\":" << native_time.cpu << "}";
+    }
+    report.success = true;
+}
+
+static void bench_worker(atomic<size_t> *next, plugin_config_t config)
+{
+    for (size_t i = (*next)++; i < files.size(); i = (*next)++)
+    {
+        file_report_t report;
+        ostringstream results;
+        // the core's own per-stage counters, next to the bench's timings
+        analysis_stats_t stats;
+        analysis_set_stats(&stats);
+        try
+        {
+            analyze_file(files[i], config, report, results);
+        }
+        catch (exception &e)
+        {
+            report.error = e.what();
+        }
+        analysis_set_stats(nullptr);
+
+        ostringstream line;
+        line << "{\"file\":" << json_string(files[i]) << ",\"success\":" << (report.success ? "true" : "false");
+        if (!report.success)
+        {
+            line << ",\"error\":" << json_string(report.error);
+        }
+        line << ",\"audio_seconds\":" << report.audio_seconds << results.str();
+        for (int s = 0; s < STAGE_COUNT; s++)
+        {
+            line << ",\"" << stage_names[s] << "\":{\"wall\":" << report.stages[s].wall << ",\"cpu\":" << report.stages[s].cpu << "}";
+        }
+        line << ",\"analysis\":" << analysis_stats_json(stats) << "}\n";
+
+        lock_guard<mutex> lock(output_mutex);
+        cout << line.str() << flush;
+        if (!report.success)
+        {
+            failed_count++;
+        }
+        total_audio_seconds += report.audio_seconds;
+        max_hpcp_difference = max(max_hpcp_difference, report.hpcp_difference);
+        for (int s = 0; s < STAGE_COUNT; s++)
+        {
+            totals[s].wall += report.stages[s].wall;
+            totals[s].cpu += report.stages[s].cpu;
+        }
+    }
+}
+
+static void usage()
+{
+    cerr << "usage: ddb_analysis_bench [-j threads] [-c chord threads] [-s bpm,key,chords] [-f] [-n] [-S] [-e] [-m MB] [-k] [file|directory]...\n"
+         << "  -j  number of files analyzed in parallel (default: number of cores)\n"
+         << "  -c  HPCP threads per file, 0 for one per core (default: 1)\n"
+         << "  -s  stages to run after decoding (default: bpm,key,chords)\n"
+         << "  -f  chords follow the rhythm (needs bpm)\n"
+         << "  -n  native HPCP kernel for the chords stage\n"
+         << "  -S  key from the chord HPCP, one spectral pass for both\n"
+         << "  -e  streaming engine, decode and stages in one network (no audio_seconds)\n"
+         << "  -m  with -e, track the beats in windows fitting this many MB\n"
+         << "  -k  compare the native HPCP kernel with Essentia's chain on every file\n"
+         << "directories contribute their audio files by extension\n"
+         << "without files, paths are read from stdin\n";
+}
+
+int main(int argc, char **argv)
+{
+    plugin_config_t config = bench_config();
+    int threads = max(1u, thread::hardware_concurrency());
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:c:s:fnSem:kh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            threads = max(1, atoi(optarg));
+            break;
+        case 'c':
+            config.chords_threads = max(0, atoi(optarg));
+            break;
+        case 's':
+        {
+            string stages = string(",") + optarg + ",";
+            config.bpm_enable = stages.find(",bpm,") != string::npos;
+            config.key_enable = stages.find(",key,") != string::npos;
+            config.chords_enable = stages.find(",chords,") != string::npos;
+            break;
+        }
+        case 'f':
+            config.chords_follow_the_rhythm = true;
+            break;
+        case 'n':
+            config.chords_native_hpcp = true;
+            break;
+        case 'S':
+            config.shared_spectrum_enable = true;
+            break;
+        case 'e':
+            config.streaming_engine_enable = true;
+            break;
+        case 'm':
+            config.memory_limit_mb = max(0, atoi(optarg));
+            break;
+        case 'k':
+            is_compare = true;
+            break;
+        default:
+            usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (is_compare && config.streaming_engine_enable)
+    {
+        cerr << "-k and -e can't be combined\n";
+        return 1;
+    }
+    if (config.chords_follow_the_rhythm && !config.bpm_enable)
+    {
+        cerr << "-f needs the bpm stage\n";
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++)
+    {
+        add_file(argv[i]);
+    }
+    if (optind == argc)
+    {
+        string line;
+        while (getline(cin, line))
+        {
+            if (!line.empty())
+            {
+                add_file(line);
+            }
+        }
+    }
+
+    essentia::init();
+
+    double wall = wall_seconds();
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for (int i = 0; i < threads; i++)
+    {
+        workers.emplace_back(bench_worker, &next, config);
+    }
+    for (thread &worker : workers)
+    {
+        worker.join();
+    }
+    wall = wall_seconds() - wall;
+
+    essentia::shutdown();
+
+    rusage usage_self;
+    getrusage(RUSAGE_SELF, &usage_self);
+    double cpu = usage_self.ru_utime.tv_sec + usage_self.ru_utime.tv_usec / 1e6 + usage_self.ru_stime.tv_sec + usage_self.ru_stime.tv_usec / 1e6;
+
+    cout << "{\"summary\":{\"files\":" << files.size()
+         << ",\"failed\":" << failed_count
+         << ",\"skipped\":" << skipped_count
+         << ",\"threads\":" << threads
+         << ",\"chords_threads\":" << config.chords_threads
+         << ",\"wall\":" << wall
+         << ",\"cpu\":" << cpu
+         << ",\"files_per_second\":" << (wall > 0 ? files.size() / wall : 0.0)
+         << ",\"audio_seconds\":" << total_audio_seconds
+         << ",\"realtime_factor\":" << (wall > 0 ? total_audio_seconds / wall : 0.0)
+         << ",\"peak_rss_kb\":" << usage_self.ru_maxrss
+         << ",\"hpcp_kernel_isa\":" << json_string(hpcp_kernel_isa());
+    if (is_compare)
+    {
+        cout << ",\"hpcp_max_difference\":" << max_hpcp_difference
+             << ",\"hpcp_within_tolerance\":" << (max_hpcp_difference <= HPCP_KERNEL_TOLERANCE ? "true" : "false");
+    }
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        cout << ",\"" << stage_names[s] << "\":{\"wall\":" << totals[s].wall << ",\"cpu\":" << totals[s].cpu << "}";
+    }
+    cout << "}}\n";
+
+    return failed_count == 0 ? 0 : 2;
+}
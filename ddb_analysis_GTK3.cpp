@@ -19,9 +19,23 @@
 #include <atomic>
 #include <functional>
 #include <mutex>
+#include <memory>
+#include <future>
+#include <deque>
+#include <map>
+#include <set>
+#include <condition_variable>
+#include <chrono>
 
 #include <unistd.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <fstream>
+#include <sstream>
 #include <gtk/gtk.h>
+#include <samplerate.h>
 #include <essentia/algorithmfactory.h>
 #include <essentia/essentia.h>
 #include <essentia/essentiamath.h>
@@ -29,6 +43,8 @@
 
 #include <deadbeef/deadbeef.h>
 #include <deadbeef/gtkui_api.h>
+#include "analysis.h"
+#include "analysis_store.h"
 
 using namespace std;
 
@@ -36,80 +52,75 @@ static DB_functions_t *deadbeef = NULL;
 static DB_misc_t plugin;
 static ddb_gtkui_t *gtkui_plugin = NULL;
 
-struct plugin_config_t
-{
-    string ChordsDetection_chromaPick;
-    bool chords_follow_the_rhythm;
-    float ChordsDetection_windowSize;
-    int chords_frame_size;
-    int chords_hop_size;
-    bool chords_enable;
-
-    string RhythmExtractor2013_method;
-    bool bpm_enable;
-    int bpm_averaging;
-    float circle_attenuration_speed;
-
-    bool key_enable;
-
-    int update_fps;
-    int strength_length;
-} config;
+plugin_config_t config;
 
-struct bpmResult
+// What the widget shows for one analyzer. A snapshot is never modified once
+// published: workers build a new one and swap it in with atomic_store(), the
+// GTK thread atomic_load()s the pointer every tick and never waits for them.
+struct bpm_snapshot_t
 {
+    string status; // shown without a result: "Calculating...", "BPM error!", ...
     bool success = false;
-    const char *uri;
+    bool is_provisional = false; // from the excerpt, the full track result follows
     int bpm = 0;
+    // the intervals are the deltas between ticks, so ticks are their prefix
+    // sums and any rolling average is one subtraction
     vector<float> ticks;
-    vector<float> estimates;
-    vector<float> bpmIntervals;
     float confidence = 0.0f;
-    plugin_config_t config;
-    string error;
+    bool is_multifeature_mode = false;
+    bool is_live = false; // from the live tracker, replaced every LIVE_UPDATE_SECONDS
 };
 
-struct keyResult
+struct key_snapshot_t
 {
+    string status;
     bool success = false;
-    const char *uri;
+    bool is_provisional = false;
     string key;
     string scale;
     float strength = 0.0f;
-    string error;
 };
 
-struct chordsResult
+struct chords_snapshot_t
 {
-    float delay;
+    string status;
     bool success = false;
-    bool is_follow_the_rhythm;
-    const char *uri;
-    vector<string> chords;
-    vector<float> strength;
-    string error;
+    bool is_provisional = false;
+    float delay = 0.0f;
+    float offset = 0.0f; // time of chords[0]
+    vector<chord_id_t> chords;
+    vector<chord_strength_t> strength;
+    bool is_follow_the_rhythm = false;
+    bool is_live = false; // from the live tracker, not a full track analysis
 };
 
 typedef struct
 {
     ddb_gtkui_widget_t base; // tihs must be placed at the top
 
-    float chord_delay;
-    vector<string> chords;
-    vector<float> chords_strength;
-    bool is_follow_the_rhythm;
-
-    int bpm = 0;
-    vector<float> bpm_ticks;
-    vector<float> bpm_estimates;
-    vector<float> bpm_intervals;
-    float bpm_confidence = 0.0f;
-    int bpm_tick_index;
-    bool is_multifeature_mode;
-
-    string key;
-    string scale;
-    float key_strength = 0.0f;
+    // published results, only through atomic_load()/atomic_store()
+    shared_ptr<const bpm_snapshot_t> bpm_state;
+    shared_ptr<const key_snapshot_t> key_state;
+    shared_ptr<const chords_snapshot_t> chords_state;
+    // orders publishers among each other, the GTK thread never takes it
+    std::mutex publishMutex;
+    atomic<bool> is_cursor_reset{false}; // the track changed, restart the beat cursor
+
+    atomic<bool> is_wake_pending{false};
+    atomic<double> duration{0.0}; // of the playing track in seconds, 0 if unknown
+
+    // GTK thread only
+    shared_ptr<const bpm_snapshot_t> shown_bpm;
+    shared_ptr<const key_snapshot_t> shown_key;
+    shared_ptr<const chords_snapshot_t> shown_chords;
+    int bpm_tick_index = 0;
+    int chord_index = -1;
+    int batch_shown_done = -1;
+    int batch_shown_total = -1;
+    guint tick_id = 0; // display tick callback, 0 while it isn't running
+    gint64 last_frame_time = 0;
+    gint64 stats_shown_time = 0;
+    bool is_stats_shown = false;
 
     GtkWidget *bpm_label;
     GtkWidget *key_label;
@@ -120,36 +131,138 @@ typedef struct
     GtkWidget *popup_item;
     GtkWidget *popup_item2;
     GtkWidget *visualizer;
+    GtkWidget *batch_progress;
+    GtkWidget *popup_item3;
+    GtkWidget *popup_item4;
+    GtkWidget *popup_item5;
     const char *uri = NULL;
     const char *last_uri = NULL;
+    // what the labels show
     string bpm_text;
     string key_text;
     string chord_text;
-    std::mutex chordMutex;
-    std::mutex bpmMutex;
-    std::mutex keyMutex;
-    bool chord_finish = false;
-    bool bpm_finish = false;
-    bool key_finish = false;
-    bool chord_success = false;
-    bool bpm_success = false;
-    bool key_success = false;
-    bool is_config_changed = false;
 
     float circle_brightness = 1.0f;
 } w_analysis_t;
 
 static w_analysis_t *w = nullptr;
 
-gboolean update_label(gpointer user_data)
+// decoded mono signal, shared read-only by every analyzer of a track
+typedef shared_ptr<const vector<essentia::Real>> audio_buffer_t;
+
+struct audio_cache_t
 {
-    lock_guard<mutex> bpmlock(w->bpmMutex);
-    lock_guard<mutex> chordlock(w->chordMutex);
-    lock_guard<mutex> keylock(w->keyMutex);
-    gtk_label_set_text(GTK_LABEL(w->bpm_label), w->bpm_text.c_str());
-    gtk_label_set_text(GTK_LABEL(w->key_label), w->key_text.c_str());
-    gtk_label_set_text(GTK_LABEL(w->chord_label), w->chord_text.c_str());
-    return FALSE;
+    std::mutex mutex;
+    string uri;
+    uint64_t decode_id = 0;
+    shared_future<audio_buffer_t> audio;
+    // short window of the same track for the provisional first pass
+    shared_future<audio_buffer_t> excerpt;
+    float excerpt_offset = 0.0f;
+    // playlist item of track_uri, decoded through DeaDBeeF's own decoder
+    string track_uri;
+    ddb_playItem_t *track = nullptr;
+} audio_cache;
+
+struct analysis_job_t
+{
+    cancel_token_t cancelled;
+    function<void(cancel_token_t)> run;
+    shared_ptr<analysis_stats_t> stats; // of the playing track, none for background jobs
+};
+
+// Two fixed-size worker pools. The playing track's jobs are interactive and
+// run on threads of normal priority that never take anything else, so they
+// don't wait behind prefetch or batch work. Background jobs run on idle
+// priority threads (CPU and I/O), on at most background_limit of them for
+// prefetch and background_cap (the CPU share) for a batch.
+struct analysis_scheduler_t
+{
+    std::mutex mutex;
+    condition_variable wakeup;
+    condition_variable background_wakeup;
+    deque<analysis_job_t> jobs;
+    deque<analysis_job_t> background_jobs;
+    vector<thread> workers;
+    vector<thread> background_workers;
+    cancel_token_t current = make_shared<atomic<bool>>(false);
+    cancel_token_t background_current = make_shared<atomic<bool>>(false);
+    int background_running = 0;
+    int background_limit = 1;
+    int background_cap = 1;
+    bool is_batch_running = false; // a batch may use up to background_cap workers
+    bool stopping = false;
+} scheduler;
+
+// Batch analysis of a selection or playlist: every track goes through the
+// background queue on all workers, results are written to BPM/INITIALKEY
+// meta (and optionally to the file tags) so the widget can skip them later.
+struct batch_t
+{
+    std::mutex mutex;
+    cancel_token_t cancelled = make_shared<atomic<bool>>(true);
+    atomic<int> total{0};
+    atomic<int> done{0};
+} batch;
+
+// Statistics of the playing track's analysis: its foreground jobs collect
+// into it, and once every enabled result is in (computed, cached or failed)
+// it is logged as one line and written to <cache dir>/stats.json
+#define TRACK_RESULT_BPM 1
+#define TRACK_RESULT_KEY 2
+#define TRACK_RESULT_CHORDS 4
+
+struct track_stats_t : analysis_stats_t
+{
+    string uri;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int expected = 0; // TRACK_RESULT_* of the enabled analyzers
+    atomic<int> finished{0};
+    atomic<bool> is_reported{false};
+};
+
+// only through atomic_load()/atomic_store(), none for live streams
+static shared_ptr<track_stats_t> track_stats;
+
+static shared_ptr<analysis_stats_t> current_track_stats()
+{
+    return atomic_load(&track_stats);
+}
+
+static void analysis_wake();
+static void analysis_wake_later();
+
+// Replaces a published snapshot. A provisional one never replaces a full
+// track result, the check and the swap happen under publishMutex.
+template <typename T>
+static void publish(shared_ptr<const T> &state, shared_ptr<const T> snapshot)
+{
+    lock_guard<mutex> lock(w->publishMutex);
+    if (snapshot->is_provisional)
+    {
+        shared_ptr<const T> current = atomic_load(&state);
+        if (current && current->success && !current->is_provisional)
+        {
+            return;
+        }
+    }
+    atomic_store(&state, move(snapshot));
+    analysis_wake_later();
+}
+
+template <typename T>
+static void publish_status(shared_ptr<const T> &state, const char *status)
+{
+    shared_ptr<T> snapshot = make_shared<T>();
+    snapshot->status = status;
+    publish(state, shared_ptr<const T>(move(snapshot)));
+}
+
+template <typename T>
+static bool is_final_result(const shared_ptr<const T> &state)
+{
+    shared_ptr<const T> current = atomic_load(&state);
+    return current && current->success && !current->is_provisional;
 }
 
 gboolean analysis_button_press(GtkWidget *widget, GdkEventButton *event, gpointer user_data)
@@ -163,6 +276,10 @@ gboolean analysis_button_press(GtkWidget *widget, GdkEventButton *event, gpointe
     return FALSE;
 }
 
+static bool is_analysis_stale(const plugin_config_t &before, const plugin_config_t &after);
+static void calculating_music(bool use_cache);
+static void scheduler_set_cpu_share(int percent);
+
 void config_response(GtkDialog *dialog, gint response_id, gpointer user_data)
 {
     GtkWidget *analysis_properties = (GtkWidget *)user_data;
@@ -174,14 +291,32 @@ void config_response(GtkDialog *dialog, gint response_id, gpointer user_data)
     GtkWidget *chords_follow_the_rhythm = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "chords_follow_the_rhythm"));
     GtkWidget *enable_bpm = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "enable_bpm"));
     GtkWidget *enable_key = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "enable_key"));
+    GtkWidget *shared_spectrum_enable = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "shared_spectrum_enable"));
     GtkWidget *enable_chords = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "enable_chords"));
     GtkWidget *bpm_averaging = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "bpm_averaging"));
     GtkWidget *chords_frame_size = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "chords_frame_size"));
     GtkWidget *chords_hop_size = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "chords_hop_size"));
+    GtkWidget *chords_threads = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "chords_threads"));
+    GtkWidget *chords_native_hpcp = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "chords_native_hpcp"));
     GtkWidget *strength_length = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "strength_length"));
+    GtkWidget *meta_read_enable = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "meta_read_enable"));
+    GtkWidget *batch_write_tags = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "batch_write_tags"));
+    GtkWidget *prefetch_count = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "prefetch_count"));
+    GtkWidget *prefetch_threads = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "prefetch_threads"));
+    GtkWidget *live_enable = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "live_enable"));
+    GtkWidget *player_decoder_enable = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "player_decoder_enable"));
+    GtkWidget *progressive_enable = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "progressive_enable"));
+    GtkWidget *streaming_engine_enable = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "streaming_engine_enable"));
+    GtkWidget *memory_limit_mb = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "memory_limit_mb"));
+    GtkWidget *progressive_excerpt_length = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "progressive_excerpt_length"));
+    GtkWidget *debug_stats = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "debug_stats"));
+    GtkWidget *background_cpu_share = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "background_cpu_share"));
+    GtkWidget *segmented_enable = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "segmented_enable"));
+    GtkWidget *segment_length = GTK_WIDGET(g_object_get_data(G_OBJECT(analysis_properties), "segment_length"));
 
     if (response_id == GTK_RESPONSE_APPLY || response_id == GTK_RESPONSE_OK)
     {
+        plugin_config_t before = config;
         config.RhythmExtractor2013_method = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(bpm_method));
         config.ChordsDetection_chromaPick = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(chords_chromaPick));
         config.update_fps = gtk_spin_button_get_value(GTK_SPIN_BUTTON(update_fps));
@@ -190,9 +325,27 @@ void config_response(GtkDialog *dialog, gint response_id, gpointer user_data)
         config.bpm_averaging = gtk_spin_button_get_value(GTK_SPIN_BUTTON(bpm_averaging));
         config.chords_frame_size = gtk_spin_button_get_value(GTK_SPIN_BUTTON(chords_frame_size));
         config.chords_hop_size = gtk_spin_button_get_value(GTK_SPIN_BUTTON(chords_hop_size));
+        config.chords_threads = gtk_spin_button_get_value(GTK_SPIN_BUTTON(chords_threads));
+        config.chords_native_hpcp = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(chords_native_hpcp));
         config.strength_length = gtk_spin_button_get_value(GTK_SPIN_BUTTON(strength_length));
+        config.meta_read_enable = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(meta_read_enable));
+        config.batch_write_tags = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(batch_write_tags));
+        config.prefetch_count = gtk_spin_button_get_value(GTK_SPIN_BUTTON(prefetch_count));
+        config.prefetch_threads = gtk_spin_button_get_value(GTK_SPIN_BUTTON(prefetch_threads));
+        config.live_enable = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(live_enable));
+        config.player_decoder_enable = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(player_decoder_enable));
+        config.progressive_enable = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(progressive_enable));
+        config.streaming_engine_enable = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(streaming_engine_enable));
+        config.memory_limit_mb = gtk_spin_button_get_value(GTK_SPIN_BUTTON(memory_limit_mb));
+        config.progressive_excerpt_length = gtk_spin_button_get_value(GTK_SPIN_BUTTON(progressive_excerpt_length));
+        config.debug_stats = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(debug_stats));
+        config.background_cpu_share = gtk_spin_button_get_value(GTK_SPIN_BUTTON(background_cpu_share));
+        scheduler_set_cpu_share(config.background_cpu_share);
+        config.segmented_enable = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(segmented_enable));
+        config.segment_length = gtk_spin_button_get_value(GTK_SPIN_BUTTON(segment_length));
         config.bpm_enable = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(enable_bpm));
         config.key_enable = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(enable_key));
+        config.shared_spectrum_enable = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(shared_spectrum_enable));
         config.chords_enable = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(enable_chords));
 
         if (config.bpm_enable)
@@ -203,7 +356,18 @@ void config_response(GtkDialog *dialog, gint response_id, gpointer user_data)
         {
             config.chords_follow_the_rhythm = false;
         }
-        w->is_config_changed = true;
+        // rebuild every text with the new settings
+        w->shown_bpm = nullptr;
+        w->shown_key = nullptr;
+        w->shown_chords = nullptr;
+        analysis_wake();
+
+        // the stages whose settings are unchanged come back from the result
+        // cache, the chords of a new ChordsDetection setup from the kept HPCP
+        if (w->uri && is_analysis_stale(before, config, w->duration))
+        {
+            calculating_music(true);
+        }
     }
     if (response_id == GTK_RESPONSE_CANCEL || response_id == GTK_RESPONSE_OK)
     {
@@ -225,6 +389,34 @@ static void analysis_config(GtkMenuItem *menuitem, gpointer user_data)
     gtk_box_pack_start(GTK_BOX(content_area), hbox2, FALSE, FALSE, 0);
     GtkWidget *hbox17 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
     gtk_box_pack_start(GTK_BOX(content_area), hbox17, FALSE, FALSE, 0);
+    GtkWidget *hbox24 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox24, FALSE, FALSE, 0);
+    GtkWidget *hbox25 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox25, FALSE, FALSE, 0);
+    GtkWidget *hbox22 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox22, FALSE, FALSE, 0);
+    GtkWidget *hbox23 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox23, FALSE, FALSE, 0);
+    GtkWidget *hbox21 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox21, FALSE, FALSE, 0);
+    GtkWidget *hbox20 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox20, FALSE, FALSE, 0);
+    GtkWidget *hbox29 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox29, FALSE, FALSE, 0);
+    GtkWidget *hbox30 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox30, FALSE, FALSE, 0);
+    GtkWidget *hbox31 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox31, FALSE, FALSE, 0);
+    GtkWidget *hbox32 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox32, FALSE, FALSE, 0);
+    GtkWidget *hbox18 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox18, FALSE, FALSE, 0);
+    GtkWidget *hbox19 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox19, FALSE, FALSE, 0);
+    GtkWidget *hbox33 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox33, FALSE, FALSE, 0);
+    GtkWidget *hbox34 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox34, FALSE, FALSE, 0);
     GtkWidget *hbox3 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
     gtk_box_pack_start(GTK_BOX(content_area), hbox3, FALSE, FALSE, 0);
     GtkWidget *hbox4 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
@@ -239,6 +431,8 @@ static void analysis_config(GtkMenuItem *menuitem, gpointer user_data)
     gtk_box_pack_start(GTK_BOX(content_area), hbox8, FALSE, FALSE, 0);
     GtkWidget *hbox9 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
     gtk_box_pack_start(GTK_BOX(content_area), hbox9, FALSE, FALSE, 0);
+    GtkWidget *hbox28 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox28, FALSE, FALSE, 0);
     GtkWidget *hbox10 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
     gtk_box_pack_start(GTK_BOX(content_area), hbox10, FALSE, FALSE, 0);
     GtkWidget *hbox11 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
@@ -251,6 +445,10 @@ static void analysis_config(GtkMenuItem *menuitem, gpointer user_data)
     gtk_box_pack_start(GTK_BOX(content_area), hbox14, FALSE, FALSE, 0);
     GtkWidget *hbox15 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
     gtk_box_pack_start(GTK_BOX(content_area), hbox15, FALSE, FALSE, 0);
+    GtkWidget *hbox26 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox26, FALSE, FALSE, 0);
+    GtkWidget *hbox27 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    gtk_box_pack_start(GTK_BOX(content_area), hbox27, FALSE, FALSE, 0);
     GtkWidget *hbox16 = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
     gtk_box_pack_start(GTK_BOX(content_area), hbox16, FALSE, FALSE, 0);
 
@@ -276,6 +474,100 @@ static void analysis_config(GtkMenuItem *menuitem, gpointer user_data)
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(update_fps), config.update_fps);
     g_object_set_data(G_OBJECT(analysis_properties), "update_fps", update_fps);
 
+    GtkWidget *meta_read_enable = gtk_check_button_new_with_label("use BPM/INITIALKEY tags");
+    gtk_container_add(GTK_CONTAINER(hbox24), meta_read_enable);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(meta_read_enable), config.meta_read_enable);
+    g_object_set_data(G_OBJECT(analysis_properties), "meta_read_enable", meta_read_enable);
+
+    GtkWidget *batch_write_tags = gtk_check_button_new_with_label("batch analysis writes tags to files");
+    gtk_container_add(GTK_CONTAINER(hbox25), batch_write_tags);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(batch_write_tags), config.batch_write_tags);
+    g_object_set_data(G_OBJECT(analysis_properties), "batch_write_tags", batch_write_tags);
+
+    GtkWidget *prefetch_count_label = gtk_label_new(NULL);
+    gtk_label_set_markup(GTK_LABEL(prefetch_count_label), "prefetch next tracks:");
+    gtk_container_add(GTK_CONTAINER(hbox22), prefetch_count_label);
+
+    GtkWidget *prefetch_count = gtk_spin_button_new_with_range(0, 10, 1);
+    gtk_container_add(GTK_CONTAINER(hbox22), prefetch_count);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(prefetch_count), config.prefetch_count);
+    g_object_set_data(G_OBJECT(analysis_properties), "prefetch_count", prefetch_count);
+
+    GtkWidget *prefetch_threads_label = gtk_label_new(NULL);
+    gtk_label_set_markup(GTK_LABEL(prefetch_threads_label), "prefetch threads:");
+    gtk_container_add(GTK_CONTAINER(hbox23), prefetch_threads_label);
+
+    GtkWidget *prefetch_threads = gtk_spin_button_new_with_range(1, max(1u, thread::hardware_concurrency()), 1);
+    gtk_container_add(GTK_CONTAINER(hbox23), prefetch_threads);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(prefetch_threads), config.prefetch_threads);
+    g_object_set_data(G_OBJECT(analysis_properties), "prefetch_threads", prefetch_threads);
+
+    GtkWidget *live_enable = gtk_check_button_new_with_label("live analysis for streams");
+    gtk_container_add(GTK_CONTAINER(hbox21), live_enable);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(live_enable), config.live_enable);
+    g_object_set_data(G_OBJECT(analysis_properties), "live_enable", live_enable);
+
+    GtkWidget *player_decoder_enable = gtk_check_button_new_with_label("decode with DeaDBeeF");
+    gtk_container_add(GTK_CONTAINER(hbox20), player_decoder_enable);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(player_decoder_enable), config.player_decoder_enable);
+    g_object_set_data(G_OBJECT(analysis_properties), "player_decoder_enable", player_decoder_enable);
+
+    GtkWidget *streaming_engine_enable = gtk_check_button_new_with_label("streaming engine (less memory, no quick estimate)");
+    gtk_container_add(GTK_CONTAINER(hbox29), streaming_engine_enable);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(streaming_engine_enable), config.streaming_engine_enable);
+    g_object_set_data(G_OBJECT(analysis_properties), "streaming_engine_enable", streaming_engine_enable);
+
+    GtkWidget *memory_limit_mb_label = gtk_label_new(NULL);
+    gtk_label_set_markup(GTK_LABEL(memory_limit_mb_label), "stream tracks larger than (MB, 0 = never):");
+    gtk_container_add(GTK_CONTAINER(hbox30), memory_limit_mb_label);
+
+    GtkWidget *memory_limit_mb = gtk_spin_button_new_with_range(0, 4096, 16);
+    gtk_container_add(GTK_CONTAINER(hbox30), memory_limit_mb);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(memory_limit_mb), config.memory_limit_mb);
+    g_object_set_data(G_OBJECT(analysis_properties), "memory_limit_mb", memory_limit_mb);
+
+    GtkWidget *debug_stats = gtk_check_button_new_with_label("statistics in tooltip and log");
+    gtk_container_add(GTK_CONTAINER(hbox31), debug_stats);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(debug_stats), config.debug_stats);
+    g_object_set_data(G_OBJECT(analysis_properties), "debug_stats", debug_stats);
+
+    GtkWidget *background_cpu_share_label = gtk_label_new(NULL);
+    gtk_label_set_markup(GTK_LABEL(background_cpu_share_label), "batch CPU share (%):");
+    gtk_container_add(GTK_CONTAINER(hbox32), background_cpu_share_label);
+
+    GtkWidget *background_cpu_share = gtk_spin_button_new_with_range(10, 100, 10);
+    gtk_container_add(GTK_CONTAINER(hbox32), background_cpu_share);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(background_cpu_share), config.background_cpu_share);
+    g_object_set_data(G_OBJECT(analysis_properties), "background_cpu_share", background_cpu_share);
+
+    GtkWidget *progressive_enable = gtk_check_button_new_with_label("quick estimate first");
+    gtk_container_add(GTK_CONTAINER(hbox18), progressive_enable);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(progressive_enable), config.progressive_enable);
+    g_object_set_data(G_OBJECT(analysis_properties), "progressive_enable", progressive_enable);
+
+    GtkWidget *progressive_excerpt_length_label = gtk_label_new(NULL);
+    gtk_label_set_markup(GTK_LABEL(progressive_excerpt_length_label), "excerpt length (s):");
+    gtk_container_add(GTK_CONTAINER(hbox19), progressive_excerpt_length_label);
+
+    GtkWidget *progressive_excerpt_length = gtk_spin_button_new_with_range(10, 120, 5);
+    gtk_container_add(GTK_CONTAINER(hbox19), progressive_excerpt_length);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(progressive_excerpt_length), config.progressive_excerpt_length);
+    g_object_set_data(G_OBJECT(analysis_properties), "progressive_excerpt_length", progressive_excerpt_length);
+
+    GtkWidget *segmented_enable = gtk_check_button_new_with_label("long tracks: play position first, in segments");
+    gtk_container_add(GTK_CONTAINER(hbox33), segmented_enable);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(segmented_enable), config.segmented_enable);
+    g_object_set_data(G_OBJECT(analysis_properties), "segmented_enable", segmented_enable);
+
+    GtkWidget *segment_length_label = gtk_label_new(NULL);
+    gtk_label_set_markup(GTK_LABEL(segment_length_label), "segment length (s):");
+    gtk_container_add(GTK_CONTAINER(hbox34), segment_length_label);
+
+    GtkWidget *segment_length = gtk_spin_button_new_with_range(10, 120, 5);
+    gtk_container_add(GTK_CONTAINER(hbox34), segment_length);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(segment_length), config.segment_length);
+    g_object_set_data(G_OBJECT(analysis_properties), "segment_length", segment_length);
+
     GtkWidget *bpm_label = gtk_label_new(NULL);
     gtk_label_set_markup(GTK_LABEL(bpm_label), "<b>BPM</b>");
     gtk_container_add(GTK_CONTAINER(hbox3), bpm_label);
@@ -326,6 +618,11 @@ static void analysis_config(GtkMenuItem *menuitem, gpointer user_data)
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(enable_key), config.key_enable);
     g_object_set_data(G_OBJECT(analysis_properties), "enable_key", enable_key);
 
+    GtkWidget *shared_spectrum_enable = gtk_check_button_new_with_label("share the spectral pass with chords");
+    gtk_container_add(GTK_CONTAINER(hbox28), shared_spectrum_enable);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(shared_spectrum_enable), config.shared_spectrum_enable);
+    g_object_set_data(G_OBJECT(analysis_properties), "shared_spectrum_enable", shared_spectrum_enable);
+
     GtkWidget *chords_label = gtk_label_new(NULL);
     gtk_label_set_markup(GTK_LABEL(chords_label), "<b>CHORDS</b>");
     gtk_container_add(GTK_CONTAINER(hbox10), chords_label);
@@ -376,6 +673,20 @@ static void analysis_config(GtkMenuItem *menuitem, gpointer user_data)
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(chords_hop_size), config.chords_hop_size);
     g_object_set_data(G_OBJECT(analysis_properties), "chords_hop_size", chords_hop_size);
 
+    GtkWidget *chords_threads_label = gtk_label_new(NULL);
+    gtk_label_set_markup(GTK_LABEL(chords_threads_label), "threads (0 = all cores):");
+    gtk_container_add(GTK_CONTAINER(hbox26), chords_threads_label);
+
+    GtkWidget *chords_threads = gtk_spin_button_new_with_range(0, 64, 1);
+    gtk_container_add(GTK_CONTAINER(hbox26), chords_threads);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(chords_threads), config.chords_threads);
+    g_object_set_data(G_OBJECT(analysis_properties), "chords_threads", chords_threads);
+
+    GtkWidget *chords_native_hpcp = gtk_check_button_new_with_label("native HPCP kernel (faster, approximate)");
+    gtk_container_add(GTK_CONTAINER(hbox27), chords_native_hpcp);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chords_native_hpcp), config.chords_native_hpcp);
+    g_object_set_data(G_OBJECT(analysis_properties), "chords_native_hpcp", chords_native_hpcp);
+
     GtkWidget *chords_follow_the_rhythm = gtk_check_button_new_with_label("follow the rhythm");
     gtk_container_add(GTK_CONTAINER(hbox16), chords_follow_the_rhythm);
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chords_follow_the_rhythm), config.chords_follow_the_rhythm);
@@ -400,478 +711,2164 @@ static void analysis_config(GtkMenuItem *menuitem, gpointer user_data)
     gtk_dialog_run(GTK_DIALOG(analysis_properties));
 }
 
-gboolean analysis_update_display(gpointer user_data)
+// length of the beat starting at tick index, the last one repeats
+static float beat_interval(const vector<float> &ticks, int index)
 {
-    w_analysis_t *w = (w_analysis_t *)user_data;
+    int last = min<int>(index, ticks.size() - 2);
+    return ticks[last + 1] - ticks[last];
+}
 
-    float t = deadbeef->streamer_get_playpos();
+// mean tempo of the averaging beats up to index
+static float rolling_bpm(const vector<float> &ticks, int index, int averaging)
+{
+    int last = min<int>(index, ticks.size() - 2);
+    int first = max(0, last - averaging);
+    float span = ticks[last + 1] - ticks[first];
+    return span > 0.0f ? 60.0f * (last - first + 1) / span : 0.0f;
+}
 
-    if (config.bpm_enable)
+// The beat shown at play position t: the last tick at most ahead seconds
+// later. Checks the hint and the beat after it first, which covers steady
+// playback; anything else (seek, new result) is a binary search.
+static int beat_at(const vector<float> &ticks, int hint, float t, float ahead)
+{
+    float target = t + ahead;
+    int size = ticks.size();
+    if (hint >= 0 && hint < size && ticks[hint] <= target)
     {
-        gtk_widget_show(w->bpm_widget);
-        if (w->bpm_finish)
+        if (hint + 1 >= size || ticks[hint + 1] > target)
         {
-            lock_guard<mutex> lock(w->bpmMutex);
-            if (w->bpm_success)
-            {
+            return hint;
+        }
+        if (hint + 2 >= size || ticks[hint + 2] > target)
+        {
+            return hint + 1;
+        }
+    }
+    return max(0, (int)(upper_bound(ticks.begin(), ticks.end(), target) - ticks.begin()) - 1);
+}
 
-                w->circle_brightness -= (1.0f / config.update_fps) / (w->bpm_intervals[w->bpm_tick_index] * config.circle_attenuration_speed);
-                if (w->circle_brightness < 0)
-                {
-                    w->circle_brightness = 0;
-                }
+static void set_label_text(GtkWidget *label, string &shown, const string &text)
+{
+    if (text != shown)
+    {
+        shown = text;
+        gtk_label_set_text(GTK_LABEL(label), shown.c_str());
+    }
+}
 
-                while (w->bpm_tick_index + 1 < w->bpm_ticks.size() && w->bpm_ticks[w->bpm_tick_index + 1] - t <= 1.0f / config.update_fps)
-                {
-                    w->circle_brightness = 1.0f;
-                    w->bpm_tick_index++;
-                }
+// One display update at play position t, dt seconds after the previous one.
+// Texts are only rebuilt when their snapshot or the current beat/chord
+// changes, and the circle is only redrawn while it fades.
+static void analysis_update_display(float t, float dt)
+{
+    shared_ptr<const bpm_snapshot_t> bpm = atomic_load(&w->bpm_state);
+    if (w->is_cursor_reset.exchange(false))
+    {
+        w->shown_bpm = nullptr;
+        w->circle_brightness = 1.0f;
+        gtk_widget_queue_draw(w->visualizer);
+    }
+    bool is_bpm_changed = bpm != w->shown_bpm;
+    if (is_bpm_changed)
+    {
+        // a new result, or the live tracker's next prediction: that one
+        // continues the beats already shown, so the cursor carries over to
+        // where it was at the previous update and the next beat still flashes
+        bool is_continued = bpm && bpm->is_live && !bpm->ticks.empty() && w->shown_bpm && w->shown_bpm->is_live && w->bpm_tick_index >= 0;
+        w->shown_bpm = bpm;
+        w->bpm_tick_index = is_continued ? beat_at(bpm->ticks, -1, t - dt, 1.0f / config.update_fps) : -1;
+    }
+
+    gtk_widget_set_visible(w->bpm_widget, config.bpm_enable);
+    if (config.bpm_enable)
+    {
+        if (!bpm || !bpm->success)
+        {
+            set_label_text(w->bpm_label, w->bpm_text, bpm ? bpm->status : "");
+        }
+        else if (bpm->ticks.size() < 2)
+        {
+            // from a BPM tag, there are no beats to follow
+            if (is_bpm_changed)
+            {
+                set_label_text(w->bpm_label, w->bpm_text, to_string(bpm->bpm) + " BPM");
+            }
+        }
+        else
+        {
+            int index = beat_at(bpm->ticks, w->bpm_tick_index, t, 1.0f / config.update_fps);
+            float brightness;
+            if (index > w->bpm_tick_index && w->bpm_tick_index >= 0)
+            {
+                brightness = 1.0f;
+            }
+            else
+            {
+                brightness = max(0.0f, w->circle_brightness - dt / (beat_interval(bpm->ticks, index) * config.circle_attenuration_speed));
+            }
 
+            if (brightness != w->circle_brightness)
+            {
+                w->circle_brightness = brightness;
                 gtk_widget_queue_draw(w->visualizer);
+            }
 
-                float bpm_current = 0.0f;
-                int count = 0;
-                for (int i = w->bpm_tick_index - config.bpm_averaging; i <= w->bpm_tick_index; i++)
-                {
-                    if (i < 0)
-                        continue;
-                    count++;
-                    bpm_current += w->bpm_intervals[i];
-                    if (i == w->bpm_tick_index)
-                    {
-                        bpm_current = bpm_current / count;
-                        bpm_current = 60 / bpm_current;
-                    }
-                }
+            if (is_bpm_changed || index != w->bpm_tick_index)
+            {
+                w->bpm_tick_index = index;
+                float bpm_current = rolling_bpm(bpm->ticks, index, config.bpm_averaging);
 
-                if (w->is_multifeature_mode)
+                string prefix = bpm->is_provisional ? "~" : "";
+                if (bpm->is_multifeature_mode)
                 {
-                    w->bpm_text = to_string(w->bpm) + "(" + to_string((int)bpm_current) + ") BPM(" + to_string(w->bpm_confidence).substr(0, config.strength_length) + ")";
+                    set_label_text(w->bpm_label, w->bpm_text, prefix + to_string(bpm->bpm) + "(" + to_string((int)bpm_current) + ") BPM(" + to_string(bpm->confidence).substr(0, config.strength_length) + ")");
                 }
                 else
                 {
 
-                    w->bpm_text = to_string(w->bpm) + "(" + to_string((int)bpm_current) + ") BPM";
+                    set_label_text(w->bpm_label, w->bpm_text, prefix + to_string(bpm->bpm) + "(" + to_string((int)bpm_current) + ") BPM");
                 }
             }
-            else
-            {
-
-                w->bpm_text = "BPM error!";
-                w->bpm_finish = false;
-            }
         }
     }
-    else
-    {
-        gtk_widget_hide(w->bpm_widget);
-    }
+
+    gtk_widget_set_visible(w->key_label, config.key_enable);
     if (config.key_enable)
     {
-        gtk_widget_show(w->key_label);
-        if (w->key_finish)
+        shared_ptr<const key_snapshot_t> key = atomic_load(&w->key_state);
+        if (key != w->shown_key)
         {
-            lock_guard<mutex> lock(w->keyMutex);
-            if (w->key_success)
+            // the key doesn't change with the play position
+            w->shown_key = key;
+            if (!key || !key->success)
             {
-
-                w->key_text = w->key + " " + w->scale + "(" + to_string(w->key_strength).substr(0, config.strength_length) + ")";
+                set_label_text(w->key_label, w->key_text, key ? key->status : "");
             }
             else
             {
 
-                w->key_text = "Key error!";
+                set_label_text(w->key_label, w->key_text, (key->is_provisional ? "~" : "") + key->key + " " + key->scale + "(" + to_string(key->strength).substr(0, config.strength_length) + ")");
             }
-            w->key_finish = false;
         }
     }
-    else
-    {
-        gtk_widget_hide(w->key_label);
-    }
+
+    gtk_widget_set_visible(w->chord_label, config.chords_enable);
     if (config.chords_enable)
     {
-        gtk_widget_show(w->chord_label);
-        if (w->chord_finish)
+        shared_ptr<const chords_snapshot_t> chords = atomic_load(&w->chords_state);
+        bool is_chords_changed = chords != w->shown_chords;
+        w->shown_chords = chords;
+        if (!chords || !chords->success || chords->chords.empty())
         {
-            lock_guard<mutex> lock(w->chordMutex);
-            if (w->chord_success)
+            if (is_chords_changed)
+            {
+                set_label_text(w->chord_label, w->chord_text, chords ? chords->status : "");
+            }
+        }
+        else
+        {
+            int n;
+            if (chords->is_follow_the_rhythm)
+            {
+                n = max(0, w->bpm_tick_index);
+            }
+            else if (chords->is_live)
+            {
+                n = chords->chords.size() - 1;
+            }
+            else
+            {
+
+                n = floor((t - chords->offset) / chords->delay);
+            }
+            if (chords->is_provisional && !chords->is_follow_the_rhythm && (n < 0 || n >= (int)chords->chords.size()))
+            {
+                // outside the segments analyzed so far
+                n = -1;
+            }
+            else if (n >= (int)chords->chords.size())
+            {
+                n = chords->chords.size() - 1;
+            }
+            if (is_chords_changed || n != w->chord_index)
             {
-                if (w->is_follow_the_rhythm)
+                w->chord_index = n;
+                if (n < 0)
                 {
-                    w->chord_text = w->chords[w->bpm_tick_index] + "(" + to_string(w->chords_strength[w->bpm_tick_index]).substr(0, config.strength_length) + ")";
+                    set_label_text(w->chord_label, w->chord_text, "...");
                 }
                 else
                 {
-
-                    int n = trunc(t / w->chord_delay);
-
-                    if (n >= w->chords.size())
-                    {
-                        n = w->chords.size() - 1;
-                    }
-                    w->chord_text = w->chords[n] + "(" + to_string(w->chords_strength[n]).substr(0, config.strength_length) + ")";
+                    set_label_text(w->chord_label, w->chord_text, chord_name(chords->chords[n]) + "(" + to_string(chord_strength_value(chords->strength[n])).substr(0, config.strength_length) + ")");
                 }
             }
-            else
-            {
-                w->chord_text = "Chord error!";
-                w->chord_finish = false;
-            }
         }
     }
-    else
-    {
-        gtk_widget_hide(w->chord_label);
-    }
-    g_idle_add(update_label, w);
 
-    if (w->is_config_changed)
+    int batch_total = batch.total;
+    int batch_done = batch.done;
+    if (batch_total != w->batch_shown_total || batch_done != w->batch_shown_done)
     {
-        w->is_config_changed = false;
-        g_timeout_add((1.0f / config.update_fps) * 1000, analysis_update_display, w);
-        return FALSE;
+        w->batch_shown_total = batch_total;
+        w->batch_shown_done = batch_done;
+        if (batch_total > 0)
+        {
+            char progress[64];
+            snprintf(progress, sizeof(progress), "%d/%d", batch_done, batch_total);
+            gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(w->batch_progress), (double)batch_done / batch_total);
+            gtk_progress_bar_set_text(GTK_PROGRESS_BAR(w->batch_progress), progress);
+        }
+        gtk_widget_set_visible(w->batch_progress, batch_done < batch_total);
+        gtk_widget_set_visible(w->popup_item3, batch_done < batch_total);
     }
-    return TRUE;
-}
-
-gboolean draw_circle(GtkWidget *widget, cairo_t *cr, gpointer data)
-{
-    w_analysis_t *w = (w_analysis_t *)data;
-
-    cairo_set_source_rgba(cr, 1, 1, 1, w->circle_brightness);
-    cairo_arc(cr, 15, 15, 12, 0, 2 * M_PI);
-    cairo_fill(cr);
-
-    return FALSE;
 }
 
-void chords_analysis_worker(const char *path, vector<float> ticks, plugin_config_t config, function<void(chordsResult)> callback)
+// "decode 1.20 s  44.1 MB" per stage that ran, then the live counters
+static string stats_tooltip_text(const track_stats_t &stats)
 {
-    chordsResult result;
-    essentia::standard::Algorithm *loader = nullptr;
-    essentia::standard::Algorithm *frameCutter = nullptr;
-    essentia::standard::Algorithm *window = nullptr;
-    essentia::standard::Algorithm *spectrum = nullptr;
-    essentia::standard::Algorithm *peaks = nullptr;
-    essentia::standard::Algorithm *hpcp = nullptr;
-    essentia::standard::Algorithm *chordsDetection = nullptr;
-
-    try
+    string text;
+    char line[128];
+    for (int s = 0; s < ANALYSIS_STAGE_COUNT; s++)
     {
-        essentia::standard::AlgorithmFactory &factory = essentia::standard::AlgorithmFactory::instance();
-        vector<essentia::Real> audioBuffer;
-        loader = factory.create("MonoLoader", "filename", path, "sampleRate", 44100);
-        loader->output("audio").set(audioBuffer);
-        loader->compute();
-
-        frameCutter = essentia::standard::AlgorithmFactory::create("FrameCutter", "frameSize", config.chords_frame_size, "hopSize", config.chords_hop_size);
-        std::vector<essentia::Real> frame;
-        frameCutter->input("signal").set(audioBuffer);
-        frameCutter->output("frame").set(frame);
-
-        window = essentia::standard::AlgorithmFactory::create("Windowing", "type", "blackmanharris92"); // option(?)
-        std::vector<essentia::Real> windowed;
-        window->output("frame").set(windowed);
-
-        spectrum = essentia::standard::AlgorithmFactory::create("Spectrum");
-        std::vector<essentia::Real> spec;
-        spectrum->output("spectrum").set(spec);
-
-        peaks = essentia::standard::AlgorithmFactory::create("SpectralPeaks");
-        std::vector<essentia::Real> freqs, mags;
-        peaks->output("frequencies").set(freqs);
-        peaks->output("magnitudes").set(mags);
-
-        hpcp = factory.create(
-            "HPCP",
-            "size", 12,     // should be 12 ?
-            "harmonics", 4, // 4~8 ?
-            "weightType", "squaredCosine",
-            "bandPreset", true,
-            "normalized", "unitMax", // unitSum ?
-            "nonLinear", true);
-
-        std::vector<essentia::Real>
-            hpcpOut;
-        hpcp->output("hpcp").set(hpcpOut);
-        std::vector<std::vector<essentia::Real>> allHPCPs;
-
-        int count = 0;
-        while (true)
-        {
-            count++;
-            frameCutter->compute();
-            if (frame.empty())
-            {
-                break;
-            }
-
-            window->input("frame").set(frame);
-            window->compute();
-
-            spectrum->input("frame").set(windowed);
-            spectrum->compute();
-
-            peaks->input("spectrum").set(spec);
-            peaks->compute();
-
-            hpcp->input("frequencies").set(freqs);
-            hpcp->input("magnitudes").set(mags);
-            hpcp->compute();
-
-            allHPCPs.push_back(hpcpOut);
-        }
-
-        vector<string> chordName;
-        vector<essentia::Real> chordStrength;
-
-        if (ticks.size() != 0)
-        {
-            chordsDetection = essentia::standard::AlgorithmFactory::create("ChordsDetectionBeats",
-                                                                           "chromaPick", config.ChordsDetection_chromaPick,
-                                                                           "hopSize", config.chords_hop_size);
-            chordsDetection->input("ticks").set(ticks);
-            result.is_follow_the_rhythm = true;
-        }
-        else
+        if (stats.runs[s] > 0)
         {
-            chordsDetection = essentia::standard::AlgorithmFactory::create("ChordsDetection", "windowSize", config.ChordsDetection_windowSize,
-                                                                           "hopSize", config.chords_hop_size);
-            result.delay = config.chords_hop_size / 44100.0;
-            result.is_follow_the_rhythm = false;
+            snprintf(line, sizeof(line), "%s %.2f s  %.1f MB\n", analysis_stage_names[s], stats.wall_us[s] / 1e6, stats.peak_bytes[s] / 1048576.0);
+            text += line;
         }
-        chordsDetection->input("pcp").set(allHPCPs);
-        chordsDetection->output("chords").set(chordName);
-        chordsDetection->output("strength").set(chordStrength);
-
-        chordsDetection->compute();
-
-        result.success = true;
-        result.chords = chordName;
-        result.strength = (vector<float>)chordStrength;
-        result.uri = path;
-
-        delete loader;
-        delete frameCutter;
-        delete window;
-        delete spectrum;
-        delete peaks;
-        // delete whitening;
-        delete hpcp;
-        delete chordsDetection;
     }
-    catch (exception &e)
+    snprintf(line, sizeof(line), "decoded %.1f s", stats.decoded_samples / 44100.0);
+    text += line;
+    if (stats.hpcp_frames_done > 0)
     {
-        result.success = false;
-        result.error = e.what();
-        if (loader)
-        {
-            delete loader;
-        }
-        if (frameCutter)
+        if (stats.hpcp_frames_expected > 0)
         {
-            delete frameCutter;
+            snprintf(line, sizeof(line), "\nHPCP frames %llu/%llu", (unsigned long long)stats.hpcp_frames_done, (unsigned long long)stats.hpcp_frames_expected);
         }
-        if (window)
-        {
-            delete window;
-        }
-        if (spectrum)
-        {
-            delete spectrum;
-        }
-        if (peaks)
-        {
-            delete peaks;
-        }
-        // if (whitening)
-        // {
-        //      delete whitening;
-        // }
-        if (hpcp)
+        else
         {
-            delete hpcp;
+            snprintf(line, sizeof(line), "\nHPCP frames %llu", (unsigned long long)stats.hpcp_frames_done);
         }
-        if (chordsDetection)
+        text += line;
+    }
+    if (stats.errors > 0)
+    {
+        snprintf(line, sizeof(line), "\nerrors %u", (unsigned int)stats.errors);
+        text += line;
+    }
+    snprintf(line, sizeof(line), "\n%.2f s since the track started", chrono::duration<double>(chrono::steady_clock::now() - stats.start).count());
+    return text + line;
+}
+
+// at most once a second, the counters change far more often
+static void analysis_update_stats_tooltip(gint64 now)
+{
+    if (!config.debug_stats)
+    {
+        if (w->is_stats_shown)
         {
-            delete chordsDetection;
+            w->is_stats_shown = false;
+            gtk_widget_set_tooltip_text(w->hbox, NULL);
         }
+        return;
+    }
+    if (w->is_stats_shown && now - w->stats_shown_time < G_USEC_PER_SEC)
+    {
+        return;
     }
-    callback(result);
+    w->is_stats_shown = true;
+    w->stats_shown_time = now;
+    shared_ptr<track_stats_t> stats = atomic_load(&track_stats);
+    gtk_widget_set_tooltip_text(w->hbox, stats ? stats_tooltip_text(*stats).c_str() : "no statistics for live streams");
 }
 
-void key_analysis_worker(const char *path, function<void(keyResult)> callback)
+static bool is_playing()
 {
-    keyResult result;
-    essentia::standard::Algorithm *loader = nullptr;
-    essentia::standard::Algorithm *keyExtractor = nullptr;
+    DB_output_t *output = deadbeef->get_output();
+    return output && output->state() == DDB_PLAYBACK_STATE_PLAYING;
+}
 
-    try
+// Frame clock tick, so it only runs while the widget is mapped. Updates at
+// most update_fps times per second and stops itself once nothing moves:
+// neither playback nor a batch is running.
+static gboolean analysis_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer user_data)
+{
+    gint64 now = gdk_frame_clock_get_frame_time(clock);
+    if (w->last_frame_time != 0 && now - w->last_frame_time < G_USEC_PER_SEC / config.update_fps)
     {
-        essentia::standard::AlgorithmFactory &factory = essentia::standard::AlgorithmFactory::instance();
-        vector<essentia::Real> audioBuffer;
-        loader = factory.create("MonoLoader", "filename", path, "sampleRate", 44100);
-        loader->output("audio").set(audioBuffer);
-        loader->compute();
-
-        keyExtractor = factory.create("KeyExtractor");
-
-        string key, scale;
-        essentia::Real strength;
-
-        keyExtractor->input("audio").set(audioBuffer);
-        keyExtractor->output("key").set(key);
-        keyExtractor->output("scale").set(scale);
-        keyExtractor->output("strength").set(strength);
+        return G_SOURCE_CONTINUE;
+    }
+    float dt = w->last_frame_time != 0 ? (now - w->last_frame_time) / (float)G_USEC_PER_SEC : 0.0f;
+    w->last_frame_time = now;
 
-        keyExtractor->compute();
+    analysis_update_display(deadbeef->streamer_get_playpos(), dt);
+    analysis_update_stats_tooltip(now);
 
-        result.success = true;
-        result.key = key;
-        result.scale = scale;
-        result.strength = strength;
-        result.uri = path;
-        delete loader;
-        delete keyExtractor;
-    }
-    catch (exception &e)
+    if (is_playing() || batch.done < batch.total)
     {
-        result.success = false;
-        result.error = e.what();
-        if (loader)
-        {
-            delete loader;
-        }
-        if (keyExtractor)
-        {
-            delete keyExtractor;
-        }
+        return G_SOURCE_CONTINUE;
     }
+    w->tick_id = 0;
+    return G_SOURCE_REMOVE;
+}
 
-    callback(result);
+// (re)starts the display tick, which updates at least once; GTK thread only
+static void analysis_wake()
+{
+    if (w->tick_id == 0)
+    {
+        w->last_frame_time = 0;
+        w->tick_id = gtk_widget_add_tick_callback(w->base.widget, analysis_tick, w, NULL);
+    }
 }
 
-void bpm_analysis_worker(const char *path, plugin_config_t config, function<void(bpmResult)> callback)
+static gboolean analysis_wake_idle(gpointer user_data)
 {
-    bpmResult result;
-    essentia::standard::Algorithm *loader = nullptr;
-    essentia::standard::Algorithm *rhythm = nullptr;
+    w->is_wake_pending = false;
+    analysis_wake();
+    return FALSE;
+}
 
-    try
+// analysis_wake() from any thread
+static void analysis_wake_later()
+{
+    if (w && !w->is_wake_pending.exchange(true))
     {
+        g_idle_add(analysis_wake_idle, w);
+    }
+}
 
-        essentia::standard::AlgorithmFactory &factory = essentia::standard::AlgorithmFactory::instance();
-        vector<essentia::Real> audioBuffer;
-        loader = factory.create("MonoLoader", "filename", path, "sampleRate", 44100);
-        loader->output("audio").set(audioBuffer);
-        loader->compute();
+gboolean draw_circle(GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+    w_analysis_t *w = (w_analysis_t *)data;
 
-        rhythm = factory.create("RhythmExtractor2013", "method", config.RhythmExtractor2013_method);
+    cairo_set_source_rgba(cr, 1, 1, 1, w->circle_brightness);
+    cairo_arc(cr, 15, 15, 12, 0, 2 * M_PI);
+    cairo_fill(cr);
 
-        essentia::Real bpmValue, confidence;
-        vector<essentia::Real> ticks, estimates, bpmIntervals;
+    return FALSE;
+}
 
-        rhythm->input("signal").set(audioBuffer);
-        rhythm->output("bpm").set(bpmValue);
-        rhythm->output("ticks").set(ticks);
-        rhythm->output("confidence").set(confidence);
-        rhythm->output("estimates").set(estimates);
-        rhythm->output("bpmIntervals").set(bpmIntervals);
+static bool scheduler_has_background_work()
+{
+    int limit = scheduler.is_batch_running ? scheduler.background_cap : min(scheduler.background_limit, scheduler.background_cap);
+    return !scheduler.background_jobs.empty() && scheduler.background_running < limit;
+}
 
-        rhythm->compute();
+// ioprio_set() has no glibc wrapper, values from linux/ioprio.h
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
 
-        result.config = config;
-        result.success = true;
-        result.bpm = trunc(bpmValue);
-        result.confidence = (float)confidence;
-        result.bpmIntervals = (vector<float>)bpmIntervals;
-        result.estimates = (vector<float>)estimates;
-        result.ticks = (vector<float>)ticks;
-        result.uri = path;
-        delete loader;
-        delete rhythm;
-    }
-    catch (exception &e)
+// For the calling thread only, and for good: an unprivileged thread can't
+// get its priority back. The HPCP threads in analysis.cpp are shared by all
+// jobs and keep the priority of the job that started them, so background
+// jobs must stay off them: prefetch and batch force chords_threads = 1.
+static void set_background_priority()
+{
+#ifdef __linux__
+    pid_t tid = syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, tid, 19);
+    struct sched_param param = {};
+    static atomic<bool> is_reported{false};
+    if (sched_setscheduler(tid, SCHED_IDLE, &param) != 0 && !is_reported.exchange(true))
     {
-        result.success = false;
-        result.error = e.what();
-        if (loader)
-        {
-            delete loader;
-        }
-        if (rhythm)
-        {
-            delete rhythm;
-        }
+        deadbeef->log("analysis: SCHED_IDLE not available, background work runs at nice 19\n");
     }
-
-    callback(result);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#else
+    setpriority(PRIO_PROCESS, 0, 19);
+#endif
 }
 
-void chords_callback(chordsResult r)
+static void scheduler_worker(bool is_background)
 {
-    if (strcmp(r.uri, w->last_uri) == 0)
+    if (is_background)
     {
-        if (r.success == true)
-        {
-            std::lock_guard<std::mutex> lock(w->chordMutex);
-            w->chords = r.chords;
-            w->chord_delay = r.delay;
-            w->chords_strength = r.strength;
-            w->is_follow_the_rhythm = r.is_follow_the_rhythm;
-            w->chord_success = true;
-            w->chord_finish = true;
-        }
-        else
-        {
-            std::lock_guard<std::mutex> lock(w->chordMutex);
-            w->chord_success = false;
-            w->chord_finish = true;
-            deadbeef->log("Chord error: %s\n", r.error.c_str());
-        }
+        set_background_priority();
     }
-}
-
-void bpm_callback(bpmResult r)
-{
-    if (strcmp(r.uri, w->last_uri) == 0)
+    condition_variable &wakeup = is_background ? scheduler.background_wakeup : scheduler.wakeup;
+    while (true)
     {
-        if (r.success == true)
+        analysis_job_t job;
         {
-            std::lock_guard<std::mutex> lock(w->bpmMutex);
-            w->bpm = r.bpm;
-            w->bpm_confidence = r.confidence;
-            w->bpm_estimates = r.estimates;
-            w->bpm_intervals = r.bpmIntervals;
-            w->bpm_ticks = r.ticks;
-            w->bpm_success = true;
-            if (r.config.RhythmExtractor2013_method == "multifeature")
+            unique_lock<mutex> lock(scheduler.mutex);
+            wakeup.wait(lock, [is_background]
+                        { return scheduler.stopping || (is_background ? scheduler_has_background_work() : !scheduler.jobs.empty()); });
+            if (scheduler.stopping)
             {
-                w->is_multifeature_mode = true;
+                return;
+            }
+            if (!is_background)
+            {
+                job = move(scheduler.jobs.front());
+                scheduler.jobs.pop_front();
             }
             else
             {
-                w->is_multifeature_mode = false;
+                job = move(scheduler.background_jobs.front());
+                scheduler.background_jobs.pop_front();
+                scheduler.background_running++;
             }
-
-            w->bpm_finish = true;
-
-            if (r.config.chords_enable && r.config.chords_follow_the_rhythm)
+        }
+        if (!*job.cancelled)
+        {
+            analysis_set_stats(job.stats.get());
+            job.run(job.cancelled);
+            analysis_set_stats(nullptr);
+        }
+        if (is_background)
+        {
+            {
+                lock_guard<mutex> lock(scheduler.mutex);
+                scheduler.background_running--;
+            }
+            scheduler.background_wakeup.notify_one();
+        }
+    }
+}
+
+// background_cap from the share of the background pool a batch may use
+static void scheduler_set_cpu_share(int percent)
+{
+    {
+        lock_guard<mutex> lock(scheduler.mutex);
+        scheduler.background_cap = max(1, (int)(scheduler.background_workers.size() * percent / 100));
+    }
+    scheduler.background_wakeup.notify_all();
+}
+
+static void scheduler_start()
+{
+    unsigned int count = max(2u, thread::hardware_concurrency());
+    {
+        lock_guard<mutex> lock(scheduler.mutex);
+        scheduler.stopping = false;
+        for (unsigned int i = 0; i < count; i++)
+        {
+            scheduler.workers.emplace_back(scheduler_worker, false);
+            scheduler.background_workers.emplace_back(scheduler_worker, true);
+        }
+    }
+    scheduler_set_cpu_share(config.background_cpu_share);
+}
+
+static void scheduler_stop()
+{
+    {
+        lock_guard<mutex> lock(scheduler.mutex);
+        scheduler.stopping = true;
+        *scheduler.current = true;
+        *scheduler.background_current = true;
+        scheduler.jobs.clear();
+        scheduler.background_jobs.clear();
+    }
+    scheduler.wakeup.notify_all();
+    scheduler.background_wakeup.notify_all();
+    for (thread &worker : scheduler.workers)
+    {
+        worker.join();
+    }
+    for (thread &worker : scheduler.background_workers)
+    {
+        worker.join();
+    }
+    scheduler.workers.clear();
+    scheduler.background_workers.clear();
+}
+
+// cancels everything queued or running and returns the token for the next track
+static cancel_token_t scheduler_restart()
+{
+    lock_guard<mutex> lock(scheduler.mutex);
+    *scheduler.current = true;
+    scheduler.jobs.clear();
+    scheduler.current = make_shared<atomic<bool>>(false);
+    return scheduler.current;
+}
+
+static void drop_cancelled_jobs(deque<analysis_job_t> &jobs)
+{
+    jobs.erase(remove_if(jobs.begin(), jobs.end(), [](const analysis_job_t &job)
+                         { return (bool)*job.cancelled; }),
+               jobs.end());
+}
+
+// same for prefetch jobs, which may use at most limit threads from now on;
+// batch jobs in the same queue have their own token and are kept
+static cancel_token_t scheduler_restart_background(int limit)
+{
+    lock_guard<mutex> lock(scheduler.mutex);
+    *scheduler.background_current = true;
+    drop_cancelled_jobs(scheduler.background_jobs);
+    scheduler.background_current = make_shared<atomic<bool>>(false);
+    scheduler.background_limit = max(1, limit);
+    return scheduler.background_current;
+}
+
+static void scheduler_set_batch_running(bool is_running)
+{
+    {
+        lock_guard<mutex> lock(scheduler.mutex);
+        scheduler.is_batch_running = is_running;
+        drop_cancelled_jobs(scheduler.background_jobs);
+    }
+    scheduler.background_wakeup.notify_all();
+}
+
+static cancel_token_t scheduler_current()
+{
+    lock_guard<mutex> lock(scheduler.mutex);
+    return scheduler.current;
+}
+
+// is_first jumps the queue, for what the listener is waiting for
+static void scheduler_submit(cancel_token_t cancelled, function<void(cancel_token_t)> run, bool is_first = false)
+{
+    {
+        lock_guard<mutex> lock(scheduler.mutex);
+        if (*cancelled || scheduler.stopping)
+        {
+            return;
+        }
+        analysis_job_t job = {cancelled, move(run), current_track_stats()};
+        if (is_first)
+        {
+            scheduler.jobs.push_front(move(job));
+        }
+        else
+        {
+            scheduler.jobs.push_back(move(job));
+        }
+    }
+    scheduler.wakeup.notify_one();
+}
+
+static void scheduler_submit_background(cancel_token_t cancelled, function<void(cancel_token_t)> run)
+{
+    {
+        lock_guard<mutex> lock(scheduler.mutex);
+        if (*cancelled || scheduler.stopping)
+        {
+            return;
+        }
+        scheduler.background_jobs.push_back({cancelled, move(run)});
+    }
+    scheduler.background_wakeup.notify_one();
+}
+
+// persistent result cache: records per (file identity, analyzer settings) in
+// one memory-mapped store for the whole library, see analysis_store.h
+static string cache_dir;
+static analysis_store_t store;
+
+// Whether a track is analyzed by analyze_streaming() instead of being decoded
+// into memory first. This is the only place memory_limit_mb applies: tracks
+// under it, and streams of unknown length, are decoded whole through the
+// player's decoder, which ignores the limit.
+static bool is_streamed(const plugin_config_t &config, double duration)
+{
+    return config.streaming_engine_enable || analysis_exceeds_memory_limit(config, duration);
+}
+
+// only the config fields each analyzer depends on
+static string bpm_settings(const plugin_config_t &config)
+{
+    return "RhythmExtractor2013 " + config.RhythmExtractor2013_method;
+}
+
+// is_track_streamed: the track goes through analyze_streaming(), see is_streamed()
+static string hpcp_settings(const plugin_config_t &config, bool is_track_streamed)
+{
+    string settings = "HPCP " + to_string(config.chords_frame_size) + " " + to_string(config.chords_hop_size);
+    // the streaming FrameCutter cuts the same frames as the standard one, but
+    // the streaming network never uses the native kernel
+    if (config.chords_native_hpcp && !is_track_streamed)
+    {
+        settings += " native";
+    }
+    return settings;
+}
+
+static string key_settings(const plugin_config_t &config, bool is_track_streamed)
+{
+    if (config.shared_spectrum_enable)
+    {
+        return "Key bgate " + hpcp_settings(config, is_track_streamed);
+    }
+    return "KeyExtractor";
+}
+
+static string chords_settings(const plugin_config_t &config, bool is_track_streamed)
+{
+    string settings = hpcp_settings(config, is_track_streamed);
+    if (config.chords_follow_the_rhythm)
+    {
+        settings += " ChordsDetectionBeats " + config.ChordsDetection_chromaPick + " " + bpm_settings(config);
+    }
+    else
+    {
+        settings += " ChordsDetection " + to_string(config.ChordsDetection_windowSize);
+    }
+    return settings;
+}
+
+// whether a config change leaves any enabled stage of a track of the given
+// duration with different settings
+static bool is_analysis_stale(const plugin_config_t &before, const plugin_config_t &after, double duration)
+{
+    bool was_streamed = is_streamed(before, duration);
+    bool is_now_streamed = is_streamed(after, duration);
+    if (before.bpm_enable != after.bpm_enable || before.key_enable != after.key_enable || before.chords_enable != after.chords_enable || before.live_enable != after.live_enable)
+    {
+        return true;
+    }
+    return (after.bpm_enable && bpm_settings(before) != bpm_settings(after)) ||
+           (after.key_enable && key_settings(before, was_streamed) != key_settings(after, is_now_streamed)) ||
+           (after.chords_enable && chords_settings(before, was_streamed) != chords_settings(after, is_now_streamed));
+}
+
+// image files (cue sheets etc.) seen with subtrack items: those all share the
+// file's uri and are decoded separately, so a per-file result would be wrong
+static mutex subtrack_mutex;
+static set<string> subtrack_uris;
+
+static void note_subtrack(const char *path, ddb_playItem_t *track)
+{
+    if (path && (deadbeef->pl_get_item_flags(track) & DDB_IS_SUBTRACK))
+    {
+        lock_guard<mutex> lock(subtrack_mutex);
+        subtrack_uris.insert(path);
+    }
+}
+
+// uri + size + mtime, empty if the file can't be stat'ed (streams etc.) or
+// holds subtracks, which are never cached
+static string file_identity(const char *path)
+{
+    struct stat st;
+    if (!path || stat(path, &st) != 0)
+    {
+        return "";
+    }
+    {
+        lock_guard<mutex> lock(subtrack_mutex);
+        if (subtrack_uris.count(path))
+        {
+            return "";
+        }
+    }
+    return string(path) + "\n" + to_string((long long)st.st_size) + "\n" + to_string((long long)st.st_mtime);
+}
+
+static void cache_init(const char *base_dir)
+{
+    if (!base_dir)
+    {
+        return;
+    }
+    cache_dir = string(base_dir) + "/analysis";
+    mkdir(base_dir, 0755);
+    mkdir(cache_dir.c_str(), 0755);
+    if (!store.open(cache_dir + "/results.store"))
+    {
+        deadbeef->log("analysis: can't open the result store in %s\n", cache_dir.c_str());
+    }
+}
+
+static bool cache_load_bpm(const char *path, const plugin_config_t &config, bpmResult &result)
+{
+    if (!store.load_bpm(file_identity(path), bpm_settings(config), result))
+    {
+        return false;
+    }
+    result.config = config;
+    result.uri = path;
+    result.success = true;
+    return true;
+}
+
+static void cache_store_bpm(const bpmResult &result)
+{
+    store.store_bpm(file_identity(result.uri), bpm_settings(result.config), result);
+}
+
+static bool cache_load_key(const char *path, const plugin_config_t &config, bool is_track_streamed, keyResult &result)
+{
+    if (!store.load_key(file_identity(path), key_settings(config, is_track_streamed), result))
+    {
+        return false;
+    }
+    result.uri = path;
+    result.success = true;
+    return true;
+}
+
+static void cache_store_key(const keyResult &result, const plugin_config_t &config, bool is_track_streamed)
+{
+    store.store_key(file_identity(result.uri), key_settings(config, is_track_streamed), result);
+}
+
+static bool cache_load_chords(const char *path, const plugin_config_t &config, bool is_track_streamed, chordsResult &result)
+{
+    if (!store.load_chords(file_identity(path), chords_settings(config, is_track_streamed), result))
+    {
+        return false;
+    }
+    result.uri = path;
+    result.success = true;
+    return true;
+}
+
+static void cache_store_chords(const chordsResult &result, const plugin_config_t &config, bool is_track_streamed)
+{
+    store.store_chords(file_identity(result.uri), chords_settings(config, is_track_streamed), result);
+}
+
+// An in-flight decode registered in audio_cache. If it fails or its job is
+// dropped before running, the waiters get the error and the slot is freed so
+// the next request decodes again.
+struct decode_request_t
+{
+    string uri;
+    ddb_playItem_t *track = nullptr;
+    double duration = 0.0; // seconds, 0 if unknown
+    double start = 0.0; // seconds, segments are decoded from the middle
+    size_t length = SIZE_MAX; // samples at most
+    uint64_t id;
+    size_t excerpt_begin;
+    size_t excerpt_length;
+    promise<audio_buffer_t> audio;
+    promise<audio_buffer_t> excerpt;
+    bool is_audio_set = false;
+    bool is_excerpt_set = false;
+
+    void fail(exception_ptr error)
+    {
+        {
+            lock_guard<mutex> lock(audio_cache.mutex);
+            if (audio_cache.decode_id == id)
+            {
+                audio_cache.uri.clear();
+                audio_cache.audio = shared_future<audio_buffer_t>();
+                audio_cache.excerpt = shared_future<audio_buffer_t>();
+            }
+        }
+        if (!is_excerpt_set)
+        {
+            excerpt.set_exception(error);
+            is_excerpt_set = true;
+        }
+        if (!is_audio_set)
+        {
+            audio.set_exception(error);
+            is_audio_set = true;
+        }
+    }
+
+    ~decode_request_t()
+    {
+        if (!is_audio_set)
+        {
+            fail(make_exception_ptr(analysis_cancelled()));
+        }
+        if (track)
+        {
+            deadbeef->pl_item_unref(track);
+        }
+    }
+};
+
+// remembers the playlist item behind path, so decodes of it can use the player's decoder
+static void set_audio_track(const char *path, ddb_playItem_t *track)
+{
+    lock_guard<mutex> lock(audio_cache.mutex);
+    if (audio_cache.track == track)
+    {
+        return;
+    }
+    if (audio_cache.track)
+    {
+        deadbeef->pl_item_unref(audio_cache.track);
+    }
+    deadbeef->pl_item_ref(track);
+    audio_cache.track = track;
+    audio_cache.track_uri = path;
+}
+
+// caller holds audio_cache.mutex
+static shared_ptr<decode_request_t> register_decode(const char *path, float excerpt_start, int excerpt_length, bool use_player_decoder)
+{
+    shared_ptr<decode_request_t> request = make_shared<decode_request_t>();
+    request->uri = path;
+    request->id = ++audio_cache.decode_id;
+    request->excerpt_begin = (size_t)(max(0.0f, excerpt_start) * 44100);
+    request->excerpt_length = (size_t)excerpt_length * 44100;
+    if (use_player_decoder && audio_cache.track && audio_cache.track_uri == path)
+    {
+        deadbeef->pl_item_ref(audio_cache.track);
+        request->track = audio_cache.track;
+    }
+
+    audio_cache.uri = path;
+    audio_cache.audio = request->audio.get_future().share();
+    audio_cache.excerpt = request->excerpt.get_future().share();
+    audio_cache.excerpt_offset = request->excerpt_begin / 44100.0f;
+    return request;
+}
+
+static void set_excerpt(decode_request_t &request, const vector<essentia::Real> &audio, size_t begin)
+{
+    size_t end = min(audio.size(), begin + request.excerpt_length);
+    request.excerpt.set_value(make_shared<const vector<essentia::Real>>(audio.begin() + begin, audio.begin() + end));
+    request.is_excerpt_set = true;
+}
+
+// called after every decoded chunk
+static void update_excerpt(decode_request_t &request, const vector<essentia::Real> &audio)
+{
+    if (!request.is_excerpt_set && audio.size() >= request.excerpt_begin + request.excerpt_length)
+    {
+        set_excerpt(request, audio, request.excerpt_begin);
+    }
+}
+
+static void finish_excerpt(decode_request_t &request, const vector<essentia::Real> &audio)
+{
+    if (!request.is_excerpt_set)
+    {
+        // shorter than the requested window: use the end of the track
+        size_t begin = audio.size() > request.excerpt_length ? audio.size() - request.excerpt_length : 0;
+        {
+            lock_guard<mutex> lock(audio_cache.mutex);
+            if (audio_cache.decode_id == request.id)
+            {
+                audio_cache.excerpt_offset = begin / 44100.0f;
+            }
+        }
+        set_excerpt(request, audio, begin);
+    }
+}
+
+// streaming loader, so the decode can be abandoned between chunks and the
+// excerpt published as soon as it has been decoded
+static void decode_with_essentia(decode_request_t &request, const cancel_token_t &cancelled, vector<essentia::Real> &audioBuffer)
+{
+    analysis_decode_file(request.uri.c_str(), cancelled, audioBuffer, [&]()
+                         { update_excerpt(request, audioBuffer); });
+}
+
+static DB_decoder_t *find_decoder(ddb_playItem_t *track)
+{
+    string decoder_id;
+    deadbeef->pl_lock();
+    const char *id = deadbeef->pl_find_meta(track, ":DECODER");
+    if (id)
+    {
+        decoder_id = id;
+    }
+    deadbeef->pl_unlock();
+
+    DB_decoder_t **decoders = deadbeef->plug_get_decoder_list();
+    for (int i = 0; decoders && decoders[i]; i++)
+    {
+        if (decoder_id == decoders[i]->plugin.id)
+        {
+            return decoders[i];
+        }
+    }
+    return nullptr;
+}
+
+static inline float sample_to_float(const char *sample, const ddb_waveformat_t &fmt)
+{
+    if (fmt.is_float)
+    {
+        return *(const float *)sample;
+    }
+    switch (fmt.bps)
+    {
+    case 8:
+        return *(const int8_t *)sample / 128.0f;
+    case 16:
+        return *(const int16_t *)sample / 32768.0f;
+    case 24:
+    {
+        const uint8_t *s = (const uint8_t *)sample;
+        int32_t v = (int32_t)((uint32_t)s[0] << 8 | (uint32_t)s[1] << 16 | (uint32_t)s[2] << 24) >> 8;
+        return v / 8388608.0f;
+    }
+    default:
+        return *(const int32_t *)sample / 2147483648.0f;
+    }
+}
+
+// live streams have no end, only their first minutes are analyzed
+#define MAX_UNKNOWN_LENGTH_SECONDS 600
+
+// Decodes through the same decoder plugin the player uses, so anything that can
+// be played (streams, cue/subtrack items, formats ffmpeg doesn't know) can be
+// analyzed, without a second ffmpeg decode. Downmixed and resampled like MonoLoader.
+// Returns false if the track has no usable decoder, audioBuffer is untouched then.
+static bool decode_with_player(decode_request_t &request, const cancel_token_t &cancelled, vector<essentia::Real> &audioBuffer)
+{
+    DB_decoder_t *decoder = find_decoder(request.track);
+    if (!decoder)
+    {
+        return false;
+    }
+    DB_fileinfo_t *fileinfo = decoder->open(0);
+    if (!fileinfo)
+    {
+        return false;
+    }
+    if (decoder->init(fileinfo, request.track) != 0)
+    {
+        decoder->free(fileinfo);
+        return false;
+    }
+
+    ddb_waveformat_t fmt = fileinfo->fmt;
+    if (fmt.channels <= 0 || fmt.samplerate <= 0 || fmt.is_bigendian || (fmt.is_float && fmt.bps != 32) || (!fmt.is_float && fmt.bps != 8 && fmt.bps != 16 && fmt.bps != 24 && fmt.bps != 32))
+    {
+        decoder->free(fileinfo);
+        return false;
+    }
+    if (request.start > 0.0 && decoder->seek(fileinfo, request.start) != 0)
+    {
+        decoder->free(fileinfo);
+        return false;
+    }
+
+    SRC_STATE *resampler = nullptr;
+    analysis_stats_t *stats = analysis_get_stats();
+    analysis_stage_timer_t timer(ANALYSIS_STAGE_DECODE);
+    try
+    {
+        int sample_size = fmt.bps / 8;
+        int frame_size = sample_size * fmt.channels;
+        double ratio = 44100.0 / fmt.samplerate;
+        size_t max_length = min(request.length, deadbeef->pl_get_item_duration(request.track) > 0 ? SIZE_MAX : (size_t)MAX_UNKNOWN_LENGTH_SECONDS * 44100);
+        if (fmt.samplerate != 44100)
+        {
+            int error = 0;
+            resampler = src_new(SRC_SINC_MEDIUM_QUALITY, 1, &error);
+            if (!resampler)
+            {
+                throw essentia::EssentiaException(src_strerror(error));
+            }
+        }
+
+        vector<char> buffer(4096 * frame_size);
+        vector<float> mono(4096);
+        vector<float> resampled((size_t)(4096 * ratio) + 64);
+        bool is_eof = false;
+        while (!is_eof && audioBuffer.size() < max_length)
+        {
+            check_cancelled(cancelled);
+            int bytes = decoder->read(fileinfo, buffer.data(), (int)buffer.size());
+            int frames = max(0, bytes) / frame_size;
+            is_eof = frames == 0;
+
+            for (int i = 0; i < frames; i++)
+            {
+                const char *frame = buffer.data() + i * frame_size;
+                float sum = 0.0f;
+                for (int c = 0; c < fmt.channels; c++)
+                {
+                    sum += sample_to_float(frame + c * sample_size, fmt);
+                }
+                mono[i] = sum / fmt.channels;
+            }
+
+            if (!resampler)
+            {
+                audioBuffer.insert(audioBuffer.end(), mono.begin(), mono.begin() + frames);
+            }
+            else
+            {
+                // on eof, loop until the resampler is drained
+                SRC_DATA data = {};
+                data.data_in = mono.data();
+                data.input_frames = frames;
+                data.end_of_input = is_eof;
+                data.src_ratio = ratio;
+                do
+                {
+                    data.data_out = resampled.data();
+                    data.output_frames = resampled.size();
+                    int error = src_process(resampler, &data);
+                    if (error)
+                    {
+                        throw essentia::EssentiaException(src_strerror(error));
+                    }
+                    audioBuffer.insert(audioBuffer.end(), resampled.begin(), resampled.begin() + data.output_frames_gen);
+                    data.data_in += data.input_frames_used;
+                    data.input_frames -= data.input_frames_used;
+                } while (data.input_frames > 0 || (is_eof && data.output_frames_gen > 0));
+            }
+            update_excerpt(request, audioBuffer);
+            if (stats)
+            {
+                stats->decoded_samples = audioBuffer.size();
+            }
+        }
+        analysis_note_bytes(ANALYSIS_STAGE_DECODE, audioBuffer.capacity() * sizeof(essentia::Real));
+    }
+    catch (...)
+    {
+        if (resampler)
+        {
+            src_delete(resampler);
+        }
+        decoder->free(fileinfo);
+        throw;
+    }
+    if (resampler)
+    {
+        src_delete(resampler);
+    }
+    decoder->free(fileinfo);
+    return true;
+}
+
+static audio_buffer_t decode_audio(decode_request_t &request, const cancel_token_t &cancelled)
+{
+    shared_ptr<vector<essentia::Real>> audioBuffer = make_shared<vector<essentia::Real>>();
+
+    if (!request.track || !decode_with_player(request, cancelled, *audioBuffer))
+    {
+        decode_with_essentia(request, cancelled, *audioBuffer);
+    }
+    finish_excerpt(request, *audioBuffer);
+
+    audioBuffer->shrink_to_fit();
+    return audioBuffer;
+}
+
+static void run_decode(decode_request_t &request, const cancel_token_t &cancelled)
+{
+    try
+    {
+        request.audio.set_value(decode_audio(request, cancelled));
+        request.is_audio_set = true;
+    }
+    catch (...)
+    {
+        request.fail(current_exception());
+    }
+}
+
+// Starts decoding path on the pool ahead of the analyzers, so that the
+// excerpt is ready early. Does nothing if path is already decoded or decoding.
+static void begin_shared_decode(const char *path, float excerpt_start, const plugin_config_t &config, cancel_token_t token)
+{
+    shared_ptr<decode_request_t> request;
+    {
+        lock_guard<mutex> lock(audio_cache.mutex);
+        if (audio_cache.audio.valid() && audio_cache.uri == path)
+        {
+            return;
+        }
+        request = register_decode(path, excerpt_start - config.progressive_excerpt_length / 2.0f, config.progressive_excerpt_length, config.player_decoder_enable);
+    }
+    scheduler_submit(token, [request](cancel_token_t cancelled)
+                     { run_decode(*request, cancelled); });
+}
+
+// The first worker asking for a uri decodes it, the others wait for that decode
+// and share the buffer. Only the latest uri is kept, older buffers are released
+// as soon as their last worker finishes. With excerpt_offset the provisional
+// excerpt is returned instead, and its start time in seconds stored there.
+audio_buffer_t load_shared_audio(const char *path, const plugin_config_t &config, const cancel_token_t &cancelled, float *excerpt_offset = nullptr)
+{
+    while (true)
+    {
+        check_cancelled(cancelled);
+
+        shared_ptr<decode_request_t> request;
+        shared_future<audio_buffer_t> audio;
+        {
+            lock_guard<mutex> lock(audio_cache.mutex);
+            if (!audio_cache.audio.valid() || audio_cache.uri != path)
+            {
+                request = register_decode(path, 0.0f, config.progressive_excerpt_length, config.player_decoder_enable);
+            }
+            audio = excerpt_offset ? audio_cache.excerpt : audio_cache.audio;
+            if (excerpt_offset)
+            {
+                *excerpt_offset = audio_cache.excerpt_offset;
+            }
+        }
+
+        if (request)
+        {
+            run_decode(*request, cancelled);
+        }
+
+        while (audio.wait_for(chrono::milliseconds(10)) != future_status::ready)
+        {
+            check_cancelled(cancelled);
+        }
+        try
+        {
+            audio_buffer_t result = audio.get();
+            if (excerpt_offset)
+            {
+                // may have been moved to the end of a short track
+                lock_guard<mutex> lock(audio_cache.mutex);
+                if (audio_cache.uri == path)
+                {
+                    *excerpt_offset = audio_cache.excerpt_offset;
+                }
+            }
+            return result;
+        }
+        catch (analysis_cancelled &)
+        {
+            // the decoding job was cancelled, not us: decode it ourselves
+            check_cancelled(cancelled);
+        }
+    }
+}
+
+// HPCP matrix of the playing track, kept under its settings so that a change
+// of the ChordsDetection parameters only re-runs ChordsDetection. Together
+// with the decoded signal in audio_cache and the ticks in the cached BPM
+// result these are the intermediates a config change can start from.
+struct hpcp_memo_t
+{
+    std::mutex mutex;
+    string uri;
+    string settings;
+    shared_ptr<const vector<essentia::Real>> frames;
+} hpcp_memo;
+
+// drops the HPCP of any other track
+static void hpcp_memo_keep(const char *path)
+{
+    lock_guard<mutex> lock(hpcp_memo.mutex);
+    if (hpcp_memo.uri != path)
+    {
+        hpcp_memo.uri.clear();
+        hpcp_memo.frames = nullptr;
+    }
+}
+
+static shared_ptr<const vector<essentia::Real>> load_shared_hpcp(const char *path, const plugin_config_t &config, const cancel_token_t &cancelled)
+{
+    string settings = hpcp_settings(config, false);
+    {
+        lock_guard<mutex> lock(hpcp_memo.mutex);
+        if (hpcp_memo.frames && hpcp_memo.uri == path && hpcp_memo.settings == settings)
+        {
+            return hpcp_memo.frames;
+        }
+    }
+    audio_buffer_t audioBuffer = load_shared_audio(path, config, cancelled);
+    shared_ptr<vector<essentia::Real>> frames = make_shared<vector<essentia::Real>>();
+    analyze_hpcp(*audioBuffer, config, cancelled, *frames);
+
+    lock_guard<mutex> lock(hpcp_memo.mutex);
+    hpcp_memo.uri = path;
+    hpcp_memo.settings = settings;
+    hpcp_memo.frames = frames;
+    return frames;
+}
+
+void chords_analysis_worker(const char *path, vector<float> ticks, plugin_config_t config, cancel_token_t cancelled, function<void(chordsResult)> callback)
+{
+    chordsResult result;
+    result.uri = path;
+    try
+    {
+        shared_ptr<const vector<essentia::Real>> hpcpFrames = load_shared_hpcp(path, config, cancelled);
+        analyze_chords_from_hpcp(*hpcpFrames, ticks, config, cancelled, result);
+        cache_store_chords(result, config, false);
+    }
+    catch (exception &e)
+    {
+        result.success = false;
+        result.error = e.what();
+    }
+    if (!*cancelled)
+    {
+        callback(result);
+    }
+}
+
+void key_analysis_worker(const char *path, plugin_config_t config, bool is_provisional, cancel_token_t cancelled, function<void(keyResult)> callback)
+{
+    keyResult result;
+    result.uri = path;
+    result.is_provisional = is_provisional;
+    try
+    {
+        float offset = 0.0f;
+        if (config.shared_spectrum_enable && !is_provisional)
+        {
+            // the chords' HPCP, computed here first when the chords wait for
+            // the beats or are cached, so the key matches key_settings()
+            shared_ptr<const vector<essentia::Real>> hpcpFrames = load_shared_hpcp(path, config, cancelled);
+            analyze_key_from_hpcp(*hpcpFrames, cancelled, result);
+        }
+        else
+        {
+            audio_buffer_t audioBuffer = load_shared_audio(path, config, cancelled, is_provisional ? &offset : nullptr);
+            analyze_key(*audioBuffer, config, cancelled, result);
+        }
+        if (!is_provisional)
+        {
+            cache_store_key(result, config, false);
+        }
+    }
+    catch (exception &e)
+    {
+        result.success = false;
+        result.error = e.what();
+    }
+
+    if (!*cancelled)
+    {
+        callback(result);
+    }
+}
+
+void bpm_analysis_worker(const char *path, plugin_config_t config, bool is_provisional, cancel_token_t cancelled, function<void(bpmResult)> callback)
+{
+    bpmResult result;
+    result.uri = path;
+    result.is_provisional = is_provisional;
+    try
+    {
+        float offset = 0.0f;
+        audio_buffer_t audioBuffer = load_shared_audio(path, config, cancelled, is_provisional ? &offset : nullptr);
+        analyze_bpm(*audioBuffer, offset, config, cancelled, result);
+        if (!is_provisional)
+        {
+            cache_store_bpm(result);
+        }
+    }
+    catch (exception &e)
+    {
+        result.success = false;
+        result.error = e.what();
+    }
+
+    if (!*cancelled)
+    {
+        callback(result);
+    }
+}
+
+// Everything config enables for path through one streaming network; results
+// are cached before the callbacks run, so bpm_callback finds the chords
+void streaming_analysis_worker(const char *path, double duration, vector<float> ticks, plugin_config_t config, cancel_token_t cancelled, function<void(bpmResult)> bpm_callback, function<void(keyResult)> key_callback, function<void(chordsResult)> chords_callback)
+{
+    bpmResult bpm;
+    keyResult key;
+    chordsResult chords;
+    bpm.uri = key.uri = chords.uri = path;
+    try
+    {
+        analyze_streaming(path, duration, config, ticks, cancelled, bpm, key, chords);
+        if (config.bpm_enable)
+        {
+            cache_store_bpm(bpm);
+        }
+        if (config.key_enable)
+        {
+            cache_store_key(key, config, true);
+        }
+        if (config.chords_enable)
+        {
+            cache_store_chords(chords, config, true);
+        }
+    }
+    catch (exception &e)
+    {
+        bpm.success = key.success = chords.success = false;
+        bpm.error = key.error = chords.error = e.what();
+    }
+
+    if (!*cancelled)
+    {
+        if (config.key_enable)
+        {
+            key_callback(key);
+        }
+        if (config.chords_enable)
+        {
+            chords_callback(chords);
+        }
+        if (config.bpm_enable)
+        {
+            bpm_callback(bpm);
+        }
+    }
+}
+
+// key and chords from one spectral pass, see analyze_key_chords()
+void key_chords_analysis_worker(const char *path, vector<float> ticks, plugin_config_t config, cancel_token_t cancelled, function<void(keyResult)> key_callback, function<void(chordsResult)> chords_callback)
+{
+    keyResult key;
+    chordsResult chords;
+    key.uri = chords.uri = path;
+    try
+    {
+        shared_ptr<const vector<essentia::Real>> hpcpFrames = load_shared_hpcp(path, config, cancelled);
+        analyze_key_from_hpcp(*hpcpFrames, cancelled, key);
+        analyze_chords_from_hpcp(*hpcpFrames, ticks, config, cancelled, chords);
+        cache_store_key(key, config, false);
+        cache_store_chords(chords, config, false);
+    }
+    catch (exception &e)
+    {
+        key.success = chords.success = false;
+        key.error = chords.error = e.what();
+    }
+
+    if (!*cancelled)
+    {
+        key_callback(key);
+        chords_callback(chords);
+    }
+}
+
+// Segmented first pass for long tracks, so that whatever is audible gets
+// labelled first: the track is cut into segments of segment_length, the one
+// at the play position is analyzed first and the run grows outwards from it,
+// ahead before behind. After a seek the next segment is taken at the new
+// position, the ones already done are kept. Each segment is decoded on its
+// own with a margin for the beat tracker, seeking with DeaDBeeF's decoder.
+#define SEGMENT_MARGIN_SECONDS 5
+
+struct segment_result_t
+{
+    vector<float> ticks; // within the segment
+    float confidence = 0.0f;
+    vector<chord_id_t> chords; // one per hop from the segment start
+    vector<chord_strength_t> strength;
+};
+
+// false if path can't be decoded from the middle
+static bool decode_segment(const char *path, size_t first, size_t length, const cancel_token_t &cancelled, vector<essentia::Real> &audio)
+{
+    decode_request_t request;
+    {
+        lock_guard<mutex> lock(audio_cache.mutex);
+        if (!audio_cache.track || audio_cache.track_uri != path)
+        {
+            return false;
+        }
+        deadbeef->pl_item_ref(audio_cache.track);
+        request.track = audio_cache.track;
+    }
+    request.uri = path;
+    request.id = 0; // not in audio_cache, nobody waits for its promises
+    request.start = first / 44100.0;
+    request.length = length;
+    request.is_audio_set = true;
+    request.is_excerpt_set = true;
+    return decode_with_player(request, cancelled, audio);
+}
+
+static void analyze_segment(const char *path, const plugin_config_t &config, size_t begin, size_t length, bool is_bpm, bool is_chords, const cancel_token_t &cancelled, segment_result_t &segment)
+{
+    size_t margin = SEGMENT_MARGIN_SECONDS * 44100;
+    size_t first = begin > margin ? begin - margin : 0;
+    vector<essentia::Real> audio;
+    if (!decode_segment(path, first, begin + length + margin - first, cancelled, audio))
+    {
+        throw runtime_error("can't decode from the middle of the track");
+    }
+
+    if (is_bpm)
+    {
+        bpmResult part;
+        analyze_bpm(audio, first / 44100.0f, config, cancelled, part);
+        float from = begin / 44100.0f, to = (begin + length) / 44100.0f;
+        segment.ticks.clear();
+        for (float tick : part.ticks)
+        {
+            if (tick >= from && tick < to)
+            {
+                segment.ticks.push_back(tick);
+            }
+        }
+        segment.confidence = part.confidence;
+    }
+    if (is_chords)
+    {
+        size_t skip = min(audio.size(), begin - first);
+        vector<essentia::Real> part(audio.begin() + skip, audio.begin() + min(audio.size(), skip + length));
+        vector<essentia::Real> hpcpFrames;
+        analyze_hpcp(part, config, cancelled, hpcpFrames);
+        chordsResult chords;
+        analyze_chords_from_hpcp(hpcpFrames, vector<float>(), config, cancelled, chords);
+        // exactly one chord per hop, so that the segments line up when merged
+        size_t frames = (length + config.chords_hop_size - 1) / config.chords_hop_size;
+        segment.chords = chords.chords;
+        segment.strength = chords.strength;
+        segment.chords.resize(frames, segment.chords.empty() ? 0 : segment.chords.back());
+        segment.strength.resize(frames, segment.strength.empty() ? 0 : segment.strength.back());
+    }
+}
+
+// segment to analyze next: the playing one, else the nearer end of the run around it
+static int next_segment(const map<int, segment_result_t> &done, int playing, int count)
+{
+    if (!done.count(playing))
+    {
+        return playing;
+    }
+    int lo = playing, hi = playing;
+    while (lo > 0 && done.count(lo - 1))
+    {
+        lo--;
+    }
+    while (hi < count - 1 && done.count(hi + 1))
+    {
+        hi++;
+    }
+    if (hi + 1 < count && (lo == 0 || hi + 1 - playing <= playing - lo + 1))
+    {
+        return hi + 1;
+    }
+    if (lo > 0)
+    {
+        return lo - 1;
+    }
+    // the run covers the track, only segments the loop hasn't counted are left
+    for (int i = 0; i < count; i++)
+    {
+        if (!done.count(i))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// publishes the run of segments around playing, merged into one timeline
+static void publish_segments(const char *path, const plugin_config_t &config, const map<int, segment_result_t> &done, int playing, size_t segment_samples, bool is_bpm, bool is_chords, function<void(bpmResult)> bpm_callback, function<void(chordsResult)> chords_callback)
+{
+    auto lo = done.find(playing), hi = next(lo);
+    while (lo != done.begin() && prev(lo)->first == lo->first - 1)
+    {
+        lo--;
+    }
+    while (hi != done.end() && hi->first == prev(hi)->first + 1)
+    {
+        hi++;
+    }
+
+    if (is_bpm)
+    {
+        bpmResult bpm;
+        bpm.uri = path;
+        bpm.config = config;
+        bpm.is_provisional = true;
+        int segments = 0;
+        for (auto i = lo; i != hi; i++, segments++)
+        {
+            bpm.ticks.insert(bpm.ticks.end(), i->second.ticks.begin(), i->second.ticks.end());
+            bpm.confidence += i->second.confidence;
+        }
+        for (size_t i = 1; i < bpm.ticks.size(); i++)
+        {
+            bpm.bpmIntervals.push_back(bpm.ticks[i] - bpm.ticks[i - 1]);
+        }
+        if (!bpm.bpmIntervals.empty())
+        {
+            bpm.success = true;
+            bpm.bpm = analysis_median_bpm(bpm.bpmIntervals);
+            bpm.confidence /= segments;
+            bpm_callback(bpm);
+        }
+    }
+    if (is_chords)
+    {
+        chordsResult chords;
+        chords.uri = path;
+        chords.success = true;
+        chords.is_provisional = true;
+        chords.is_follow_the_rhythm = false;
+        chords.delay = config.chords_hop_size / 44100.0;
+        chords.offset = lo->first * segment_samples / 44100.0;
+        for (auto i = lo; i != hi; i++)
+        {
+            chords.chords.insert(chords.chords.end(), i->second.chords.begin(), i->second.chords.end());
+            chords.strength.insert(chords.strength.end(), i->second.strength.begin(), i->second.strength.end());
+        }
+        chords_callback(chords);
+    }
+}
+
+// Provisional results only: it stops once the full track results are in, and
+// its errors are dropped, the full track jobs report their own.
+void segmented_analysis_worker(const char *path, plugin_config_t config, double duration, bool is_bpm, bool is_chords, cancel_token_t cancelled, function<void(bpmResult)> bpm_callback, function<void(chordsResult)> chords_callback)
+{
+    // on hop boundaries, so that the chords of all segments share one grid
+    size_t segment_samples = max<size_t>(1, (size_t)config.segment_length * 44100 / config.chords_hop_size) * config.chords_hop_size;
+    size_t total_samples = duration * 44100;
+    int count = (total_samples + segment_samples - 1) / segment_samples;
+    map<int, segment_result_t> done;
+    try
+    {
+        while ((int)done.size() < count)
+        {
+            check_cancelled(cancelled);
+            is_bpm = is_bpm && !is_final_result(w->bpm_state);
+            is_chords = is_chords && !is_final_result(w->chords_state);
+            if (!is_bpm && !is_chords)
+            {
+                return;
+            }
+            int playing = min(count - 1, max(0, (int)(deadbeef->streamer_get_playpos() * 44100 / segment_samples)));
+            int segment = next_segment(done, playing, count);
+            size_t begin = segment * segment_samples;
+            analyze_segment(path, config, begin, min(segment_samples, total_samples - begin), is_bpm, is_chords, cancelled, done[segment]);
+            if (!*cancelled)
+            {
+                publish_segments(path, config, done, done.count(playing) ? playing : segment, segment_samples, is_bpm, is_chords, bpm_callback, chords_callback);
+            }
+        }
+    }
+    catch (exception &)
+    {
+        // e.g. a decoder that can't seek, the full track results still come
+    }
+}
+
+// Look-ahead: the next tracks of the playing playlist are analyzed into the
+// result cache as background jobs, so they start with their results ready.
+struct prefetch_item_t
+{
+    string uri;
+    ddb_playItem_t *track;
+};
+
+// upcoming tracks in play order, referenced; empty when the order can't be predicted
+static vector<prefetch_item_t> prefetch_next_tracks(int count)
+{
+    vector<prefetch_item_t> items;
+    ddb_shuffle_t shuffle = deadbeef->streamer_get_shuffle();
+    ddb_repeat_t repeat = deadbeef->streamer_get_repeat();
+    if (count <= 0 || shuffle == DDB_SHUFFLE_TRACKS || shuffle == DDB_SHUFFLE_RANDOM || repeat == DDB_REPEAT_SINGLE)
+    {
+        return items;
+    }
+    ddb_playItem_t *playing = deadbeef->streamer_get_playing_track();
+    if (!playing)
+    {
+        return items;
+    }
+    ddb_playlist_t *plt = deadbeef->plt_get_for_idx(deadbeef->streamer_get_current_playlist());
+
+    deadbeef->pl_lock();
+    ddb_playItem_t *it = playing;
+    deadbeef->pl_item_ref(it);
+    for (int i = 0; i < count; i++)
+    {
+        ddb_playItem_t *next = deadbeef->pl_get_next(it, PL_MAIN);
+        if (!next && repeat == DDB_REPEAT_ALL && plt)
+        {
+            next = deadbeef->plt_get_first(plt, PL_MAIN);
+        }
+        deadbeef->pl_item_unref(it);
+        it = next;
+        if (!it || it == playing)
+        {
+            break;
+        }
+        // streams can't be analyzed ahead
+        const char *uri = deadbeef->pl_find_meta(it, ":URI");
+        if (uri && deadbeef->pl_get_item_duration(it) > 0)
+        {
+            deadbeef->pl_item_ref(it);
+            items.push_back({uri, it});
+        }
+    }
+    if (it)
+    {
+        deadbeef->pl_item_unref(it);
+    }
+    deadbeef->pl_unlock();
+
+    if (plt)
+    {
+        deadbeef->plt_unref(plt);
+    }
+    deadbeef->pl_item_unref(playing);
+    return items;
+}
+
+// Completes bpm/key/chords for one track: what the result cache has is loaded,
+// the rest is analyzed and cached. Decodes privately, the shared slot stays
+// with the playing track. Throws on errors and cancellation.
+static void analyze_track(decode_request_t &request, const plugin_config_t &config, const cancel_token_t &cancelled, bpmResult &bpm, keyResult &key, chordsResult &chords)
+{
+    const char *path = request.uri.c_str();
+    bpm.uri = key.uri = chords.uri = path;
+    bool is_track_streamed = is_streamed(config, request.duration);
+    bool need_bpm = config.bpm_enable && !cache_load_bpm(path, config, bpm);
+    bool need_key = config.key_enable && !cache_load_key(path, config, is_track_streamed, key);
+    bool need_chords = config.chords_enable && !cache_load_chords(path, config, is_track_streamed, chords);
+    if (config.chords_follow_the_rhythm && !config.bpm_enable)
+    {
+        // there are no beats to follow, as in calculating_music()
+        need_chords = false;
+    }
+    if (!need_bpm && !need_key && !need_chords)
+    {
+        return;
+    }
+
+    if (is_track_streamed)
+    {
+        plugin_config_t needed = config;
+        needed.bpm_enable = need_bpm;
+        needed.key_enable = need_key;
+        needed.chords_enable = need_chords;
+        analyze_streaming(path, request.duration, needed, config.chords_follow_the_rhythm ? bpm.ticks : vector<float>(), cancelled, bpm, key, chords);
+        if (need_bpm)
+        {
+            cache_store_bpm(bpm);
+        }
+        if (need_key)
+        {
+            cache_store_key(key, config, is_track_streamed);
+        }
+        if (need_chords)
+        {
+            cache_store_chords(chords, config, is_track_streamed);
+        }
+        return;
+    }
+
+    audio_buffer_t audioBuffer = decode_audio(request, cancelled);
+    if (need_bpm)
+    {
+        analyze_bpm(*audioBuffer, 0.0f, config, cancelled, bpm);
+        cache_store_bpm(bpm);
+    }
+    if (need_key && need_chords && config.shared_spectrum_enable)
+    {
+        analyze_key_chords(*audioBuffer, config.chords_follow_the_rhythm ? bpm.ticks : vector<float>(), config, cancelled, key, chords);
+        cache_store_key(key, config, is_track_streamed);
+        cache_store_chords(chords, config, is_track_streamed);
+        return;
+    }
+    if (need_key && config.shared_spectrum_enable)
+    {
+        // the chords are cached or not wanted, the key still comes from the HPCP
+        vector<essentia::Real> hpcpFrames;
+        analyze_hpcp(*audioBuffer, config, cancelled, hpcpFrames);
+        analyze_key_from_hpcp(hpcpFrames, cancelled, key);
+        cache_store_key(key, config, is_track_streamed);
+    }
+    else if (need_key)
+    {
+        analyze_key(*audioBuffer, config, cancelled, key);
+        cache_store_key(key, config, is_track_streamed);
+    }
+    if (need_chords)
+    {
+        analyze_chords(*audioBuffer, config.chords_follow_the_rhythm ? bpm.ticks : vector<float>(), config, cancelled, chords);
+        cache_store_chords(chords, config, is_track_streamed);
+    }
+}
+
+// private decode of a playlist item, takes over the caller's reference
+static shared_ptr<decode_request_t> make_track_request(const string &uri, ddb_playItem_t *track, const plugin_config_t &config)
+{
+    shared_ptr<decode_request_t> request = make_shared<decode_request_t>();
+    request->uri = uri;
+    request->id = 0; // never registered in audio_cache
+    request->excerpt_begin = 0;
+    request->excerpt_length = 0;
+    request->duration = deadbeef->pl_get_item_duration(track);
+    note_subtrack(uri.c_str(), track);
+    if (config.player_decoder_enable)
+    {
+        request->track = track;
+    }
+    else
+    {
+        deadbeef->pl_item_unref(track);
+    }
+    return request;
+}
+
+static void prefetch_worker(shared_ptr<decode_request_t> request, plugin_config_t config, cancel_token_t cancelled)
+{
+    bpmResult bpm;
+    keyResult key;
+    chordsResult chords;
+    try
+    {
+        analyze_track(*request, config, cancelled, bpm, key, chords);
+    }
+    catch (exception &e)
+    {
+        if (!*cancelled)
+        {
+            deadbeef->log("Prefetch error: %s: %s\n", request->uri.c_str(), e.what());
+        }
+    }
+}
+
+// replaces any pending prefetch with the tracks following the playing one
+static void prefetch_schedule(const plugin_config_t &config)
+{
+    cancel_token_t token = scheduler_restart_background(config.prefetch_threads);
+    plugin_config_t prefetch_config = config;
+    prefetch_config.chords_threads = 1; // stay within prefetch_threads and at idle priority, see set_background_priority()
+    for (prefetch_item_t &item : prefetch_next_tracks(config.prefetch_count))
+    {
+        scheduler_submit_background(token, bind(prefetch_worker, make_track_request(item.uri, item.track, config), prefetch_config, placeholders::_1));
+    }
+}
+
+// "A"/"minor" -> "Am", the usual INITIALKEY notation
+static string key_to_meta(const string &key, const string &scale)
+{
+    return scale == "minor" ? key + "m" : key;
+}
+
+static bool key_from_meta(const char *value, keyResult &result)
+{
+    if (!value || value[0] < 'A' || value[0] > 'G')
+    {
+        return false;
+    }
+    string key(1, value[0]);
+    const char *rest = value + 1;
+    if (*rest == '#' || *rest == 'b')
+    {
+        key += *rest++;
+    }
+    if (*rest == 'm' && rest[1] == '\0')
+    {
+        result.scale = "minor";
+    }
+    else if (*rest == '\0')
+    {
+        result.scale = "major";
+    }
+    else
+    {
+        return false;
+    }
+    result.key = key;
+    result.strength = 0.0f;
+    result.success = true;
+    return true;
+}
+
+static void write_track_meta(ddb_playItem_t *track, const plugin_config_t &config, const bpmResult &bpm, const keyResult &key)
+{
+    if (bpm.success)
+    {
+        deadbeef->pl_replace_meta(track, "BPM", to_string(bpm.bpm).c_str());
+    }
+    if (key.success)
+    {
+        deadbeef->pl_replace_meta(track, "INITIALKEY", key_to_meta(key.key, key.scale).c_str());
+    }
+    if (config.batch_write_tags && (bpm.success || key.success))
+    {
+        DB_decoder_t *decoder = find_decoder(track);
+        if (decoder && decoder->write_metadata)
+        {
+            decoder->write_metadata(track);
+        }
+    }
+}
+
+static void batch_finished()
+{
+    scheduler_set_batch_running(false);
+    deadbeef->sendmessage(DB_EV_PLAYLISTCHANGED, 0, DDB_PLAYLIST_CHANGE_CONTENT, 0);
+}
+
+// a playlist item reference released with whatever drops it, so jobs that
+// are cancelled before they run don't leak their item
+typedef shared_ptr<ddb_playItem_t> track_ref_t;
+
+static track_ref_t hold_track(ddb_playItem_t *track)
+{
+    return track_ref_t(track, [](ddb_playItem_t *it)
+                       { deadbeef->pl_item_unref(it); });
+}
+
+static void batch_worker(shared_ptr<decode_request_t> request, track_ref_t track, plugin_config_t config, cancel_token_t cancelled)
+{
+    bpmResult bpm;
+    keyResult key;
+    chordsResult chords;
+    try
+    {
+        analyze_track(*request, config, cancelled, bpm, key, chords);
+        write_track_meta(track.get(), config, bpm, key);
+    }
+    catch (exception &e)
+    {
+        if (!*cancelled)
+        {
+            deadbeef->log("Batch analysis error: %s: %s\n", request->uri.c_str(), e.what());
+        }
+    }
+
+    if (!*cancelled && ++batch.done == batch.total)
+    {
+        batch_finished();
+    }
+}
+
+static void batch_stop()
+{
+    lock_guard<mutex> lock(batch.mutex);
+    *batch.cancelled = true;
+    batch.total = 0;
+    batch.done = 0;
+    scheduler_set_batch_running(false);
+}
+
+// takes over the references of tracks
+static void batch_start(vector<ddb_playItem_t *> &tracks)
+{
+    vector<pair<string, ddb_playItem_t *>> items;
+    for (ddb_playItem_t *track : tracks)
+    {
+        string uri;
+        deadbeef->pl_lock();
+        const char *meta = deadbeef->pl_find_meta(track, ":URI");
+        if (meta)
+        {
+            uri = meta;
+        }
+        deadbeef->pl_unlock();
+
+        if (uri.empty() || deadbeef->pl_get_item_duration(track) <= 0)
+        {
+            // streams can't be analyzed as a whole
+            deadbeef->pl_item_unref(track);
+            continue;
+        }
+        items.push_back(make_pair(uri, track));
+    }
+
+    batch_stop();
+    if (items.empty())
+    {
+        return;
+    }
+    lock_guard<mutex> lock(batch.mutex);
+    batch.cancelled = make_shared<atomic<bool>>(false);
+    batch.done = 0;
+    batch.total = items.size();
+    scheduler_set_batch_running(true);
+    analysis_wake_later();
+
+    plugin_config_t batch_config = config;
+    batch_config.chords_threads = 1; // the batch is already spread over all workers, and stays at idle priority
+    for (pair<string, ddb_playItem_t *> &item : items)
+    {
+        // one reference for the decode request, one for writing the meta
+        deadbeef->pl_item_ref(item.second);
+        scheduler_submit_background(batch.cancelled, bind(batch_worker, make_track_request(item.first, item.second, batch_config), hold_track(item.second), batch_config, placeholders::_1));
+    }
+}
+
+static int batch_action_callback(DB_plugin_action_t *action, ddb_action_context_t ctx)
+{
+    vector<ddb_playItem_t *> tracks;
+    if (ctx == DDB_ACTION_CTX_NOWPLAYING)
+    {
+        ddb_playItem_t *playing = deadbeef->streamer_get_playing_track();
+        if (playing)
+        {
+            tracks.push_back(playing);
+        }
+    }
+    else
+    {
+        ddb_playlist_t *plt = deadbeef->action_get_playlist();
+        if (!plt)
+        {
+            return 0;
+        }
+        deadbeef->pl_lock();
+        ddb_playItem_t *it = deadbeef->plt_get_first(plt, PL_MAIN);
+        while (it)
+        {
+            if (ctx == DDB_ACTION_CTX_PLAYLIST || deadbeef->pl_is_selected(it))
+            {
+                deadbeef->pl_item_ref(it);
+                tracks.push_back(it);
+            }
+            ddb_playItem_t *next = deadbeef->pl_get_next(it, PL_MAIN);
+            deadbeef->pl_item_unref(it);
+            it = next;
+        }
+        deadbeef->pl_unlock();
+        deadbeef->plt_unref(plt);
+    }
+    batch_start(tracks);
+    return 0;
+}
+
+static DB_plugin_action_t batch_action;
+
+static void stop_batch_analysis(GtkMenuItem *menuitem, gpointer user_data)
+{
+    batch_stop();
+    analysis_wake();
+}
+
+static gboolean show_store_message(gpointer data)
+{
+    char *text = (char *)data;
+    GtkWidget *dialog = gtk_message_dialog_new(NULL, GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_INFO, GTK_BUTTONS_CLOSE, "%s", text);
+    g_signal_connect(dialog, "response", G_CALLBACK(gtk_widget_destroy), NULL);
+    gtk_widget_show(dialog);
+    g_free(text);
+    return FALSE;
+}
+
+static string choose_store_file(GtkFileChooserAction action, const char *title)
+{
+    bool is_save = action == GTK_FILE_CHOOSER_ACTION_SAVE;
+    GtkWidget *dialog = gtk_file_chooser_dialog_new(title, NULL, action, "_Cancel", GTK_RESPONSE_CANCEL, is_save ? "_Save" : "_Open", GTK_RESPONSE_ACCEPT, NULL);
+    if (is_save)
+    {
+        gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), TRUE);
+        gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), "results.store");
+    }
+    string path;
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT)
+    {
+        char *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+        if (filename)
+        {
+            path = filename;
+            g_free(filename);
+        }
+    }
+    gtk_widget_destroy(dialog);
+    return path;
+}
+
+// Export/import run as background jobs, a library store takes a while to
+// copy; the outcome is shown once they're done.
+static void export_results(GtkMenuItem *menuitem, gpointer user_data)
+{
+    string path = choose_store_file(GTK_FILE_CHOOSER_ACTION_SAVE, "Export analysis results");
+    if (path.empty())
+    {
+        return;
+    }
+    scheduler_submit_background(make_shared<atomic<bool>>(false), [path](cancel_token_t cancelled)
+                                {
+                                    int count = store.export_to(path);
+                                    string text = count < 0 ? "Can't export the analysis results to " + path : to_string(count) + " analysis results exported to " + path;
+                                    g_idle_add(show_store_message, g_strdup(text.c_str())); });
+}
+
+static void import_results(GtkMenuItem *menuitem, gpointer user_data)
+{
+    string path = choose_store_file(GTK_FILE_CHOOSER_ACTION_OPEN, "Import analysis results");
+    if (path.empty())
+    {
+        return;
+    }
+    scheduler_submit_background(make_shared<atomic<bool>>(false), [path](cancel_token_t cancelled)
+                                {
+                                    int count = store.import_from(path);
+                                    string text = count < 0 ? path + " is not an analysis result store" : to_string(count) + " analysis results imported from " + path;
+                                    g_idle_add(show_store_message, g_strdup(text.c_str())); });
+}
+
+static DB_plugin_action_t *plugin_get_actions(DB_playItem_t *it)
+{
+    return &batch_action;
+}
+
+static string json_quote(const string &text)
+{
+    string quoted = "\"";
+    for (unsigned char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if (c < 0x20)
+        {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        }
+        else
+        {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+static string track_stats_json(const track_stats_t &stats)
+{
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - stats.start).count();
+    return "{\"uri\":" + json_quote(stats.uri) + ",\"elapsed\":" + to_string(elapsed) + ",\"analysis\":" + analysis_stats_json(stats) + "}";
+}
+
+// marks results of the playing track as done, reports the track after the last one
+static void track_stats_finish(int results, bool is_error)
+{
+    shared_ptr<track_stats_t> stats = atomic_load(&track_stats);
+    if (!stats)
+    {
+        return;
+    }
+    if (is_error)
+    {
+        stats->errors++;
+    }
+    int finished = stats->finished.fetch_or(results) | results;
+    if ((finished & stats->expected) != stats->expected || stats->is_reported.exchange(true))
+    {
+        return;
+    }
+    string json = track_stats_json(*stats);
+    if (config.debug_stats)
+    {
+        deadbeef->log("analysis stats: %s\n", json.c_str());
+    }
+    if (!cache_dir.empty())
+    {
+        // replaced atomically, readers never see half a file
+        string path = cache_dir + "/stats.json";
+        string tmp = path + ".tmp";
+        {
+            ofstream out(tmp);
+            out << json << "\n";
+        }
+        rename(tmp.c_str(), path.c_str());
+    }
+}
+
+static void apply_chords_result(const chordsResult &r)
+{
+    shared_ptr<chords_snapshot_t> snapshot = make_shared<chords_snapshot_t>();
+    snapshot->success = true;
+    snapshot->is_provisional = r.is_provisional;
+    snapshot->chords = r.chords;
+    snapshot->delay = r.delay;
+    snapshot->offset = r.offset;
+    snapshot->strength = r.strength;
+    snapshot->is_follow_the_rhythm = r.is_follow_the_rhythm;
+    publish(w->chords_state, shared_ptr<const chords_snapshot_t>(move(snapshot)));
+    if (!r.is_provisional)
+    {
+        track_stats_finish(TRACK_RESULT_CHORDS, false);
+    }
+}
+
+static void apply_bpm_result(const bpmResult &r)
+{
+    shared_ptr<bpm_snapshot_t> snapshot = make_shared<bpm_snapshot_t>();
+    snapshot->success = true;
+    snapshot->is_provisional = r.is_provisional;
+    snapshot->bpm = r.bpm;
+    snapshot->confidence = r.confidence;
+    snapshot->ticks = r.ticks;
+    snapshot->is_multifeature_mode = r.config.RhythmExtractor2013_method == "multifeature";
+    publish(w->bpm_state, shared_ptr<const bpm_snapshot_t>(move(snapshot)));
+    if (!r.is_provisional)
+    {
+        track_stats_finish(TRACK_RESULT_BPM, false);
+    }
+}
+
+static void apply_key_result(const keyResult &r)
+{
+    shared_ptr<key_snapshot_t> snapshot = make_shared<key_snapshot_t>();
+    snapshot->success = true;
+    snapshot->is_provisional = r.is_provisional;
+    snapshot->key = r.key;
+    snapshot->scale = r.scale;
+    snapshot->strength = r.strength;
+    publish(w->key_state, shared_ptr<const key_snapshot_t>(move(snapshot)));
+    if (!r.is_provisional)
+    {
+        track_stats_finish(TRACK_RESULT_KEY, false);
+    }
+}
+
+void chords_callback(chordsResult r)
+{
+    if (strcmp(r.uri, w->last_uri) == 0)
+    {
+        if (r.is_provisional)
+        {
+            if (r.success)
+            {
+                apply_chords_result(r);
+            }
+        }
+        else if (r.success == true)
+        {
+            apply_chords_result(r);
+        }
+        else
+        {
+            publish_status(w->chords_state, "Chord error!");
+            deadbeef->log("Chord error: %s\n", r.error.c_str());
+            track_stats_finish(TRACK_RESULT_CHORDS, true);
+        }
+    }
+}
+
+void bpm_callback(bpmResult r)
+{
+    if (strcmp(r.uri, w->last_uri) == 0)
+    {
+        if (r.is_provisional)
+        {
+            // never replaces the full track result, and errors wait for it
+            if (r.success)
             {
-                w->chord_text = "Calculating...";
+                apply_bpm_result(r);
+            }
+        }
+        else if (r.success == true)
+        {
+            apply_bpm_result(r);
 
-                g_idle_add(update_label, w);
-                thread chords_worker(chords_analysis_worker, r.uri, w->bpm_ticks, config, chords_callback);
-                chords_worker.detach();
+            if (r.config.chords_enable && r.config.chords_follow_the_rhythm)
+            {
+                chordsResult cached;
+                if (cache_load_chords(r.uri, r.config, is_streamed(r.config, w->duration), cached))
+                {
+                    apply_chords_result(cached);
+                }
+                else
+                {
+                    publish_status(w->chords_state, "Calculating...");
+                    scheduler_submit(scheduler_current(), bind(chords_analysis_worker, r.uri, r.ticks, config, placeholders::_1, chords_callback));
+                }
             }
         }
         else
         {
-            std::lock_guard<std::mutex> lock(w->bpmMutex);
-            w->bpm_success = false;
-            w->bpm_finish = true;
+            publish_status(w->bpm_state, "BPM error!");
             deadbeef->log("BPM error: %s\n", r.error.c_str());
+            // chords that follow the rhythm won't come either
+            track_stats_finish(TRACK_RESULT_BPM | (r.config.chords_follow_the_rhythm ? TRACK_RESULT_CHORDS : 0), true);
         }
     }
 }
@@ -880,74 +2877,616 @@ void key_callback(keyResult r)
 {
     if (strcmp(r.uri, w->last_uri) == 0)
     {
-        if (r.success == true)
+        if (r.is_provisional)
+        {
+            if (r.success)
+            {
+                apply_key_result(r);
+            }
+        }
+        else if (r.success == true)
         {
-            std::lock_guard<std::mutex> lock(w->keyMutex);
-            w->key = r.key;
-            w->scale = r.scale;
-            w->key_strength = r.strength;
-            w->key_success = true;
-            w->key_finish = true;
+            apply_key_result(r);
         }
         else
         {
-            std::lock_guard<std::mutex> lock(w->keyMutex);
-            w->key_success = false;
-            w->key_finish = true;
+            publish_status(w->key_state, "Key error!");
             deadbeef->log("Key error: %s\n", r.error.c_str());
+            track_stats_finish(TRACK_RESULT_KEY, true);
+        }
+    }
+}
+
+// Live tracker for streams and endless sets: fed from the playback tap, it keeps
+// only a few seconds of onset strength and chroma, and re-estimates tempo,
+// beat phase, chord and key as the audio plays.
+#define LIVE_FRAME_SIZE 4096
+#define LIVE_HOP_SIZE 512
+#define LIVE_ONSET_SECONDS 8
+#define LIVE_UPDATE_SECONDS 0.5f
+#define LIVE_KEY_SECONDS 30
+
+struct live_tracker_t
+{
+    std::mutex mutex;
+    condition_variable wakeup;
+    deque<float> input; // mono samples from the tap, at most a couple of seconds
+    int samplerate = 0;
+    float input_time = 0.0f; // play position of the newest sample in input
+    thread worker;
+    atomic<bool> stopping{false};
+    bool running = false;
+} live;
+
+static void live_tap(void *ctx, const ddb_audio_data_t *data)
+{
+    int channels = data->fmt->channels;
+    float playpos = deadbeef->streamer_get_playpos();
+    {
+        lock_guard<mutex> lock(live.mutex);
+        if (live.samplerate != data->fmt->samplerate)
+        {
+            live.input.clear();
+            live.samplerate = data->fmt->samplerate;
+        }
+        for (int i = 0; i < data->nframes; i++)
+        {
+            float sum = 0.0f;
+            for (int c = 0; c < channels; c++)
+            {
+                sum += data->data[i * channels + c];
+            }
+            live.input.push_back(sum / channels);
+        }
+        // the tracker fell behind, old audio is useless for a live estimate
+        while (live.input.size() > (size_t)live.samplerate * 2)
+        {
+            live.input.pop_front();
+        }
+        live.input_time = playpos;
+    }
+    live.wakeup.notify_one();
+}
+
+// tempo from the autocorrelation of the onset function, weighted towards
+// 120 BPM, then the beat phase that best lines up with recent onsets
+static bool live_estimate_beats(const deque<essentia::Real> &onsets, float frame_rate, float &period, int &last_beat)
+{
+    int n = onsets.size();
+    int lag_min = (int)(frame_rate * 60.0f / 200.0f);
+    int lag_max = (int)(frame_rate * 60.0f / 60.0f);
+    if (n < lag_max * 2)
+    {
+        return false;
+    }
+
+    float mean = 0.0f;
+    for (essentia::Real v : onsets)
+    {
+        mean += v;
+    }
+    mean /= n;
+
+    float best_score = 0.0f;
+    int best_lag = 0;
+    for (int lag = lag_min; lag <= lag_max; lag++)
+    {
+        float sum = 0.0f;
+        for (int i = 0; i + lag < n; i++)
+        {
+            sum += (onsets[i] - mean) * (onsets[i + lag] - mean);
+        }
+        float octave = log2f((60.0f * frame_rate / lag) / 120.0f);
+        float score = sum / (n - lag) * expf(-0.5f * octave * octave);
+        if (score > best_score)
+        {
+            best_score = score;
+            best_lag = lag;
+        }
+    }
+    if (best_lag == 0)
+    {
+        return false;
+    }
+
+    best_score = 0.0f;
+    int best_offset = 0;
+    for (int offset = 0; offset < best_lag; offset++)
+    {
+        float sum = 0.0f;
+        for (int i = n - 1 - offset; i >= 0; i -= best_lag)
+        {
+            sum += onsets[i];
+        }
+        if (sum > best_score)
+        {
+            best_score = sum;
+            best_offset = offset;
+        }
+    }
+    period = best_lag / frame_rate;
+    last_beat = n - 1 - best_offset;
+    return true;
+}
+
+static string live_chord_name(const string &key, const string &scale)
+{
+    return scale == "minor" ? key + "m" : key;
+}
+
+static void live_publish(float period, float last_beat_time, float now, const string &chord, float chord_strength, const string &key, const string &scale, float key_strength)
+{
+    vector<float> ticks;
+    // a few past beats plus the predicted ones, until the next update replaces them
+    for (float tick = last_beat_time - 4 * period; tick < now + 4.0f; tick += period)
+    {
+        if (tick >= 0.0f)
+        {
+            ticks.push_back(tick);
+        }
+    }
+    if (ticks.empty())
+    {
+        return;
+    }
+    shared_ptr<bpm_snapshot_t> bpm = make_shared<bpm_snapshot_t>();
+    bpm->success = true;
+    bpm->bpm = trunc(60.0f / period);
+    bpm->ticks = move(ticks);
+    bpm->is_live = true;
+    publish(w->bpm_state, shared_ptr<const bpm_snapshot_t>(move(bpm)));
+
+    shared_ptr<chords_snapshot_t> chords = make_shared<chords_snapshot_t>();
+    chords->success = true;
+    chords->chords.assign(1, chord_intern(chord));
+    chords->strength.assign(1, chord_strength_quantize(chord_strength));
+    chords->is_live = true;
+    publish(w->chords_state, shared_ptr<const chords_snapshot_t>(move(chords)));
+
+    shared_ptr<key_snapshot_t> key_snapshot = make_shared<key_snapshot_t>();
+    key_snapshot->success = true;
+    key_snapshot->is_provisional = true;
+    key_snapshot->key = key;
+    key_snapshot->scale = scale;
+    key_snapshot->strength = key_strength;
+    publish(w->key_state, shared_ptr<const key_snapshot_t>(move(key_snapshot)));
+}
+
+static void live_worker(plugin_config_t config)
+{
+    essentia::standard::Algorithm *window = nullptr;
+    essentia::standard::Algorithm *spectrum = nullptr;
+    essentia::standard::Algorithm *onset = nullptr;
+    essentia::standard::Algorithm *peaks = nullptr;
+    essentia::standard::Algorithm *hpcp = nullptr;
+    essentia::standard::Algorithm *chordKey = nullptr;
+    essentia::standard::Algorithm *trackKey = nullptr;
+
+    try
+    {
+        int samplerate = 0;
+        float frame_rate = 0.0f;
+        vector<essentia::Real> frame(LIVE_FRAME_SIZE, 0.0f), windowed, spec, phase, freqs, mags, hpcpOut, chroma(12), keyChroma(12);
+        essentia::Real onsetValue;
+        string chord, chordScale, key, scale;
+        essentia::Real chordStrength, keyStrength;
+        deque<essentia::Real> onsets;
+        deque<vector<essentia::Real>> chromas;
+        int hops_since_update = 0;
+
+        while (!live.stopping)
+        {
+            vector<essentia::Real> hop;
+            float hop_time;
+            {
+                unique_lock<mutex> lock(live.mutex);
+                live.wakeup.wait_for(lock, chrono::milliseconds(50), []
+                                     { return live.stopping || live.input.size() >= LIVE_HOP_SIZE; });
+                if (live.stopping || live.input.size() < LIVE_HOP_SIZE)
+                {
+                    continue;
+                }
+                hop.assign(live.input.begin(), live.input.begin() + LIVE_HOP_SIZE);
+                live.input.erase(live.input.begin(), live.input.begin() + LIVE_HOP_SIZE);
+                hop_time = live.input_time - (float)live.input.size() / live.samplerate;
+
+                if (samplerate != live.samplerate)
+                {
+                    // (re)configure for the output samplerate
+                    samplerate = live.samplerate;
+                    frame_rate = (float)samplerate / LIVE_HOP_SIZE;
+                    onsets.clear();
+                    chromas.clear();
+                    delete window;
+                    delete spectrum;
+                    delete onset;
+                    delete peaks;
+                    delete hpcp;
+                    delete chordKey;
+                    delete trackKey;
+                    window = essentia::standard::AlgorithmFactory::create("Windowing", "type", "blackmanharris92", "size", LIVE_FRAME_SIZE);
+                    spectrum = essentia::standard::AlgorithmFactory::create("Spectrum", "size", LIVE_FRAME_SIZE);
+                    onset = essentia::standard::AlgorithmFactory::create("OnsetDetection", "method", "flux", "sampleRate", (essentia::Real)samplerate);
+                    peaks = essentia::standard::AlgorithmFactory::create("SpectralPeaks", "sampleRate", (essentia::Real)samplerate);
+                    hpcp = essentia::standard::AlgorithmFactory::create("HPCP",
+                                                                        "size", 12,
+                                                                        "harmonics", 4,
+                                                                        "weightType", "squaredCosine",
+                                                                        "bandPreset", true,
+                                                                        "normalized", "unitMax",
+                                                                        "nonLinear", true,
+                                                                        "sampleRate", (essentia::Real)samplerate);
+                    // the same triad profile ChordsDetection uses internally
+                    chordKey = essentia::standard::AlgorithmFactory::create("Key", "profileType", "tonictriad", "usePolyphony", false, "useThreeChords", false);
+                    trackKey = essentia::standard::AlgorithmFactory::create("Key");
+
+                    window->input("frame").set(frame);
+                    window->output("frame").set(windowed);
+                    spectrum->input("frame").set(windowed);
+                    spectrum->output("spectrum").set(spec);
+                    onset->input("spectrum").set(spec);
+                    onset->input("phase").set(phase);
+                    onset->output("onsetDetection").set(onsetValue);
+                    peaks->input("spectrum").set(spec);
+                    peaks->output("frequencies").set(freqs);
+                    peaks->output("magnitudes").set(mags);
+                    hpcp->input("frequencies").set(freqs);
+                    hpcp->input("magnitudes").set(mags);
+                    hpcp->output("hpcp").set(hpcpOut);
+                    chordKey->input("pcp").set(chroma);
+                    chordKey->output("key").set(chord);
+                    chordKey->output("scale").set(chordScale);
+                    chordKey->output("strength").set(chordStrength);
+                    trackKey->input("pcp").set(keyChroma);
+                    trackKey->output("key").set(key);
+                    trackKey->output("scale").set(scale);
+                    trackKey->output("strength").set(keyStrength);
+                }
+            }
+
+            frame.erase(frame.begin(), frame.begin() + LIVE_HOP_SIZE);
+            frame.insert(frame.end(), hop.begin(), hop.end());
+
+            window->compute();
+            spectrum->compute();
+            phase.assign(spec.size(), 0.0f);
+            onset->compute();
+            peaks->compute();
+            hpcp->compute();
+
+            onsets.push_back(onsetValue);
+            if (onsets.size() > LIVE_ONSET_SECONDS * frame_rate)
+            {
+                onsets.pop_front();
+            }
+            chromas.push_back(hpcpOut);
+            if (chromas.size() > max(1.0f, config.ChordsDetection_windowSize * frame_rate))
+            {
+                chromas.pop_front();
+            }
+            // slow moving average for the key, constant memory
+            float alpha = 1.0f / (LIVE_KEY_SECONDS * frame_rate);
+            for (int i = 0; i < 12 && i < (int)hpcpOut.size(); i++)
+            {
+                keyChroma[i] += alpha * (hpcpOut[i] - keyChroma[i]);
+            }
+
+            if (++hops_since_update < LIVE_UPDATE_SECONDS * frame_rate)
+            {
+                continue;
+            }
+            hops_since_update = 0;
+
+            float period;
+            int last_beat;
+            if (!live_estimate_beats(onsets, frame_rate, period, last_beat))
+            {
+                continue;
+            }
+            fill(chroma.begin(), chroma.end(), 0.0f);
+            for (const vector<essentia::Real> &c : chromas)
+            {
+                for (int i = 0; i < 12 && i < (int)c.size(); i++)
+                {
+                    chroma[i] += c[i] / chromas.size();
+                }
+            }
+            chordKey->compute();
+            trackKey->compute();
+
+            // onset frames lag the hop they were computed on by half a frame
+            float now = hop_time + (float)LIVE_HOP_SIZE / samplerate;
+            float last_beat_time = now - (onsets.size() - 1 - last_beat) / frame_rate - (LIVE_FRAME_SIZE / 2.0f) / samplerate;
+            live_publish(period, last_beat_time, now, live_chord_name(chord, chordScale), chordStrength, key, scale, keyStrength);
         }
     }
+    catch (exception &e)
+    {
+        deadbeef->log("Live analysis error: %s\n", e.what());
+    }
+    delete window;
+    delete spectrum;
+    delete onset;
+    delete peaks;
+    delete hpcp;
+    delete chordKey;
+    delete trackKey;
+}
+
+static void live_start(const plugin_config_t &config)
+{
+    if (live.running)
+    {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(live.mutex);
+        live.input.clear();
+        live.samplerate = 0;
+    }
+    live.stopping = false;
+    live.worker = thread(live_worker, config);
+    live.running = true;
+    deadbeef->vis_waveform_listen(&live, live_tap);
+}
+
+static void live_stop()
+{
+    if (!live.running)
+    {
+        return;
+    }
+    deadbeef->vis_waveform_unlisten(&live);
+    live.stopping = true;
+    live.wakeup.notify_all();
+    live.worker.join();
+    live.running = false;
+}
+
+// streams have no duration and can't be analyzed as a whole
+static bool is_live_track(const plugin_config_t &config)
+{
+    bool is_live = false;
+    ddb_playItem_t *track = deadbeef->streamer_get_playing_track();
+    if (track)
+    {
+        is_live = config.live_enable && deadbeef->pl_get_item_duration(track) <= 0;
+        deadbeef->pl_item_unref(track);
+    }
+    return is_live;
+}
+
+static bool is_segmented(const plugin_config_t &config, double duration)
+{
+    return config.segmented_enable && config.player_decoder_enable && duration >= 2 * config.segment_length;
+}
+
+// the segmented first pass for what isn't cached, ahead of every queued job;
+// chords that follow the rhythm wait for the full track beats
+static void segmented_schedule(const cancel_token_t &token, double duration, bool is_bpm, bool is_chords)
+{
+    is_chords = is_chords && !config.chords_follow_the_rhythm;
+    if (is_segmented(config, duration) && (is_bpm || is_chords))
+    {
+        scheduler_submit(token, bind(segmented_analysis_worker, w->uri, config, duration, is_bpm, is_chords, placeholders::_1, bpm_callback, chords_callback), true);
+    }
+}
+
+// One streaming job for whatever the caches don't have; no player decoder
+// and no quick estimate, the network reads the file itself
+static void streaming_schedule(const cancel_token_t &token, bool use_cache, double duration, const bpmResult &cachedBpm, bool is_bpm_cached, const keyResult &cachedKey, bool is_key_cached)
+{
+    chordsResult cachedChords;
+    bool is_chords_cached = config.chords_enable && use_cache && cache_load_chords(w->uri, config, true, cachedChords);
+    bool is_follow = config.chords_enable && config.chords_follow_the_rhythm;
+
+    plugin_config_t job = config;
+    job.bpm_enable = config.bpm_enable && !is_bpm_cached;
+    job.key_enable = config.key_enable && !is_key_cached;
+    job.chords_enable = config.chords_enable && !is_chords_cached && (!is_follow || config.bpm_enable);
+
+    if (is_bpm_cached)
+    {
+        apply_bpm_result(cachedBpm);
+    }
+    else
+    {
+        publish_status(w->bpm_state, job.bpm_enable ? "Calculating..." : "...");
+    }
+    if (is_key_cached)
+    {
+        apply_key_result(cachedKey);
+    }
+    else
+    {
+        publish_status(w->key_state, job.key_enable ? "Calculating..." : "...");
+    }
+    if (is_chords_cached)
+    {
+        apply_chords_result(cachedChords);
+    }
+    else
+    {
+        publish_status(w->chords_state, job.chords_enable ? "Calculating..." : config.chords_enable ? "Waiting..." : "...");
+    }
+
+    if (job.bpm_enable || job.key_enable || job.chords_enable)
+    {
+        vector<float> ticks = is_follow && is_bpm_cached ? cachedBpm.ticks : vector<float>();
+        scheduler_submit(token, bind(streaming_analysis_worker, w->uri, duration, ticks, job, placeholders::_1, bpm_callback, key_callback, chords_callback));
+    }
+    segmented_schedule(token, duration, job.bpm_enable, job.chords_enable);
 }
 
-static void calculating_music()
+// with use_cache, results from the on-disk cache are applied directly and no
+// worker is started for them
+static void calculating_music(bool use_cache)
 {
-    lock_guard<mutex> chordlock(w->chordMutex);
-    lock_guard<mutex> keylock(w->keyMutex);
-    w->chord_finish = false;
-    w->bpm_finish = false;
-    w->key_finish = false;
-    w->chord_success = false;
-    w->bpm_success = false;
-    w->key_success = false;
     w->last_uri = w->uri;
+    // Recalculate starts over from the decoded signal
+    hpcp_memo_keep(use_cache ? w->uri : "");
+    cancel_token_t token = scheduler_restart();
+
+    if (is_live_track(config))
+    {
+        // the live tracker keeps running across metadata changes of the same stream
+        scheduler_restart_background(config.prefetch_threads);
+        live_start(config);
+        publish_status(w->bpm_state, config.bpm_enable ? "Listening..." : "...");
+        publish_status(w->key_state, config.key_enable ? "Listening..." : "...");
+        publish_status(w->chords_state, config.chords_enable ? "Listening..." : "...");
+        atomic_store(&track_stats, shared_ptr<track_stats_t>());
+        return;
+    }
+    live_stop();
+
+    shared_ptr<track_stats_t> stats = make_shared<track_stats_t>();
+    stats->uri = w->uri;
+    stats->expected = (config.bpm_enable ? TRACK_RESULT_BPM : 0) | (config.key_enable ? TRACK_RESULT_KEY : 0) | (config.chords_enable ? TRACK_RESULT_CHORDS : 0);
+    atomic_store(&track_stats, stats);
+
+    ddb_playItem_t *track = deadbeef->streamer_get_playing_track();
+    double duration = 0.0;
+    if (track)
+    {
+        set_audio_track(w->uri, track);
+        note_subtrack(w->uri, track);
+        duration = deadbeef->pl_get_item_duration(track);
+    }
+    w->duration = duration;
+
+    bpmResult cachedBpm;
+    keyResult cachedKey;
+    bool is_bpm_cached = config.bpm_enable && use_cache && cache_load_bpm(w->uri, config, cachedBpm);
+    bool is_key_cached = config.key_enable && use_cache && cache_load_key(w->uri, config, is_streamed(config, duration), cachedKey);
+    if (track && use_cache && config.meta_read_enable)
+    {
+        // BPM/INITIALKEY written by a batch run or another tagger; a bare
+        // BPM has no beats, so it can't drive follow-the-rhythm
+        deadbeef->pl_lock();
+        const char *bpm_meta = deadbeef->pl_find_meta(track, "BPM");
+        if (config.bpm_enable && !is_bpm_cached && bpm_meta && atof(bpm_meta) > 0 && !(config.chords_enable && config.chords_follow_the_rhythm))
+        {
+            cachedBpm.bpm = (int)atof(bpm_meta);
+            cachedBpm.config = config;
+            cachedBpm.uri = w->uri;
+            cachedBpm.success = true;
+            is_bpm_cached = true;
+        }
+        if (config.key_enable && !is_key_cached && key_from_meta(deadbeef->pl_find_meta(track, "INITIALKEY"), cachedKey))
+        {
+            cachedKey.uri = w->uri;
+            is_key_cached = true;
+        }
+        deadbeef->pl_unlock();
+    }
+    if (track)
+    {
+        deadbeef->pl_item_unref(track);
+    }
+    if (is_streamed(config, duration))
+    {
+        streaming_schedule(token, use_cache, duration, cachedBpm, is_bpm_cached, cachedKey, is_key_cached);
+        prefetch_schedule(config);
+        return;
+    }
+    // the segments cover the beats at the play position and beyond
+    bool is_bpm_progressive = config.progressive_enable && config.bpm_enable && !is_bpm_cached && !is_segmented(config, duration);
+    bool is_key_progressive = config.progressive_enable && config.key_enable && !is_key_cached;
+
+    // quick pass on an excerpt around the play position first, the full
+    // track jobs queue behind it
+    if (is_bpm_progressive || is_key_progressive)
+    {
+        begin_shared_decode(w->uri, deadbeef->streamer_get_playpos(), config, token);
+    }
+    if (is_bpm_progressive)
+    {
+        scheduler_submit(token, bind(bpm_analysis_worker, w->uri, config, true, placeholders::_1, bpm_callback));
+    }
+    if (is_key_progressive)
+    {
+        scheduler_submit(token, bind(key_analysis_worker, w->uri, config, true, placeholders::_1, key_callback));
+    }
 
     if (config.bpm_enable)
     {
-        w->bpm_text = "Calculating...";
-        thread bpm_worker(bpm_analysis_worker, w->uri, config, bpm_callback);
-        bpm_worker.detach();
+        if (is_bpm_cached)
+        {
+            apply_bpm_result(cachedBpm);
+        }
+        else
+        {
+            publish_status(w->bpm_state, "Calculating...");
+            scheduler_submit(token, bind(bpm_analysis_worker, w->uri, config, false, placeholders::_1, bpm_callback));
+        }
     }
     else
     {
-        w->bpm_text = "...";
+        publish_status(w->bpm_state, "...");
     }
-    if (config.key_enable)
+    chordsResult cachedChords;
+    bool is_chords_cached = config.chords_enable && use_cache && cache_load_chords(w->uri, config, false, cachedChords);
+    // one spectral pass for both, unless the chords have to wait for the beats
+    bool is_shared = config.shared_spectrum_enable && config.key_enable && !is_key_cached && config.chords_enable && !is_chords_cached && !config.chords_follow_the_rhythm;
+    if (is_shared)
+    {
+        publish_status(w->key_state, "Calculating...");
+        publish_status(w->chords_state, "Calculating...");
+        scheduler_submit(token, bind(key_chords_analysis_worker, w->uri, vector<float>(), config, placeholders::_1, key_callback, chords_callback));
+    }
+    else if (config.key_enable)
     {
-        w->key_text = "Calculating...";
-        thread key_worker(key_analysis_worker, w->uri, key_callback);
-        key_worker.detach();
+        if (is_key_cached)
+        {
+            apply_key_result(cachedKey);
+        }
+        else
+        {
+            publish_status(w->key_state, "Calculating...");
+            scheduler_submit(token, bind(key_analysis_worker, w->uri, config, false, placeholders::_1, key_callback));
+        }
     }
     else
     {
-        w->key_text = "...";
+        publish_status(w->key_state, "...");
     }
-    if (config.chords_enable && !config.chords_follow_the_rhythm)
+    if (is_shared)
     {
-        w->chord_text = "Calculating...";
+        // submitted with the key
+    }
+    else if (is_chords_cached)
+    {
+        apply_chords_result(cachedChords);
+    }
+    else if (config.chords_enable && !config.chords_follow_the_rhythm)
+    {
+        publish_status(w->chords_state, "Calculating...");
         vector<float> ticks;
         ticks.clear();
-        thread chords_worker(chords_analysis_worker, w->uri, ticks, config, chords_callback);
-        chords_worker.detach();
+        scheduler_submit(token, bind(chords_analysis_worker, w->uri, ticks, config, placeholders::_1, chords_callback));
+    }
+    else if (config.chords_enable && is_bpm_cached)
+    {
+        publish_status(w->chords_state, "Calculating...");
+        scheduler_submit(token, bind(chords_analysis_worker, w->uri, cachedBpm.ticks, config, placeholders::_1, chords_callback));
     }
     else if (config.chords_enable)
     {
-        w->chord_text = "Waiting...";
+        publish_status(w->chords_state, "Waiting...");
     }
     else
     {
-        w->chord_text = "...";
+        publish_status(w->chords_state, "...");
     }
-    g_idle_add(update_label, w);
+    segmented_schedule(token, duration, config.bpm_enable && !is_bpm_cached, config.chords_enable && !is_chords_cached);
+
+    prefetch_schedule(config);
+}
+
+static void recalculate_music(GtkMenuItem *menuitem, gpointer user_data)
+{
+    calculating_music(false);
 }
 
 void analysis_init_gui(ddb_gtkui_widget_t *s)
@@ -968,10 +3507,15 @@ void analysis_init_gui(ddb_gtkui_widget_t *s)
     w->chord_label = gtk_label_new(w->chord_text.c_str());
     w->visualizer = gtk_drawing_area_new();
     gtk_widget_set_size_request(w->visualizer, 30, 30);
+    w->batch_progress = gtk_progress_bar_new();
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(w->batch_progress), TRUE);
 
     w->popup = gtk_menu_new();
     w->popup_item = gtk_menu_item_new_with_mnemonic("Configure");
     w->popup_item2 = gtk_menu_item_new_with_mnemonic("Recalculate");
+    w->popup_item3 = gtk_menu_item_new_with_mnemonic("Stop batch analysis");
+    w->popup_item4 = gtk_menu_item_new_with_mnemonic("Export results...");
+    w->popup_item5 = gtk_menu_item_new_with_mnemonic("Import results...");
 
     w->bpm_widget = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
     w->hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
@@ -980,6 +3524,7 @@ void analysis_init_gui(ddb_gtkui_widget_t *s)
     gtk_box_pack_start(GTK_BOX(w->bpm_widget), w->bpm_label, FALSE, FALSE, 5);
     gtk_box_pack_start(GTK_BOX(w->hbox), w->key_label, FALSE, FALSE, 5);
     gtk_box_pack_start(GTK_BOX(w->hbox), w->chord_label, FALSE, FALSE, 5);
+    gtk_box_pack_start(GTK_BOX(w->hbox), w->batch_progress, FALSE, FALSE, 5);
 
     gtk_label_set_line_wrap(GTK_LABEL(w->bpm_label), TRUE);
     gtk_label_set_line_wrap_mode(GTK_LABEL(w->bpm_label), PANGO_WRAP_WORD_CHAR);
@@ -999,15 +3544,24 @@ void analysis_init_gui(ddb_gtkui_widget_t *s)
     gtk_widget_show(w->popup_item);
     gtk_menu_shell_append(GTK_MENU_SHELL(w->popup), w->popup_item2);
     gtk_widget_show(w->popup_item2);
+    gtk_menu_shell_append(GTK_MENU_SHELL(w->popup), w->popup_item3);
+    gtk_menu_shell_append(GTK_MENU_SHELL(w->popup), w->popup_item4);
+    gtk_widget_show(w->popup_item4);
+    gtk_menu_shell_append(GTK_MENU_SHELL(w->popup), w->popup_item5);
+    gtk_widget_show(w->popup_item5);
     gtk_widget_show_all(w->base.widget);
+    gtk_widget_hide(w->batch_progress);
 
     gtk_widget_add_events(w->base.widget, GDK_BUTTON_PRESS_MASK);
     g_signal_connect(w->base.widget, "button-press-event", G_CALLBACK(analysis_button_press), w);
     g_signal_connect_after(GTK_WIDGET(w->popup_item), "activate", G_CALLBACK(analysis_config), w);
-    g_signal_connect_after(GTK_WIDGET(w->popup_item2), "activate", G_CALLBACK(calculating_music), w);
+    g_signal_connect_after(GTK_WIDGET(w->popup_item2), "activate", G_CALLBACK(recalculate_music), w);
+    g_signal_connect_after(GTK_WIDGET(w->popup_item3), "activate", G_CALLBACK(stop_batch_analysis), w);
+    g_signal_connect_after(GTK_WIDGET(w->popup_item4), "activate", G_CALLBACK(export_results), w);
+    g_signal_connect_after(GTK_WIDGET(w->popup_item5), "activate", G_CALLBACK(import_results), w);
     g_signal_connect(w->visualizer, "draw", G_CALLBACK(draw_circle), w);
 
-    g_timeout_add((1.0f / config.update_fps) * 1000, analysis_update_display, w);
+    analysis_wake();
 }
 
 void w_analysis_init(ddb_gtkui_widget_t *s)
@@ -1028,12 +3582,10 @@ static void check_url_update()
         w->uri = deadbeef->pl_find_meta(track, ":URI");
         if (w->uri)
         {
-            lock_guard<mutex> bpmlock(w->bpmMutex);
-            w->bpm_tick_index = 0;
-            w->circle_brightness = 1.0f;
             if (!w->last_uri || strcmp(w->uri, w->last_uri) != 0)
             {
-                calculating_music();
+                w->is_cursor_reset = true;
+                calculating_music(true);
             }
         }
     }
@@ -1042,6 +3594,17 @@ static void check_url_update()
 static int analysis_message(ddb_gtkui_widget_t *widget, uint32_t id, uintptr_t ctx, uint32_t p1, uint32_t p2)
 {
     check_url_update();
+    switch (id)
+    {
+    case DB_EV_SONGSTARTED:
+    case DB_EV_SONGCHANGED:
+    case DB_EV_PAUSED:
+    case DB_EV_SEEKED:
+    case DB_EV_STOP:
+        // the display tick stops while nothing plays
+        analysis_wake_later();
+        break;
+    }
     return 0;
 }
 
@@ -1054,8 +3617,6 @@ ddb_gtkui_widget_t *w_analysis_create()
         return NULL;
     }
 
-    w->is_follow_the_rhythm = config.chords_follow_the_rhythm;
-
     w->base.widget = gtk_event_box_new();
     w->base.init = w_analysis_init;
     w->base.destroy = w_analysis_destroy;
@@ -1083,13 +3644,30 @@ void get_config()
     config.strength_length = deadbeef->conf_get_int("analysis.strength_length", 4);
     config.chords_frame_size = deadbeef->conf_get_int("analysis.chords_frame_size", 8192);
     config.chords_hop_size = deadbeef->conf_get_int("analysis.chords_hop_size", 1024);
+    config.chords_threads = deadbeef->conf_get_int("analysis.chords_threads", 0);
+    config.chords_native_hpcp = (bool)deadbeef->conf_get_int("analysis.chords_native_hpcp", 0);
     config.bpm_averaging = deadbeef->conf_get_int("bpm_averaging", 15);
     config.circle_attenuration_speed = deadbeef->conf_get_float("analysis.circle_attenuration_speed", 0.75);
     config.ChordsDetection_windowSize = deadbeef->conf_get_float("analysis.ChordsDetection_windowSize", 1.8);
     config.chords_follow_the_rhythm = (bool)deadbeef->conf_get_int("analysis.chords_follow_the_rhythm", 0);
     config.chords_enable = (bool)deadbeef->conf_get_int("analysis.chords_enable", 1);
     config.key_enable = (bool)deadbeef->conf_get_int("analysis.key_enable", 1);
+    config.shared_spectrum_enable = (bool)deadbeef->conf_get_int("analysis.shared_spectrum_enable", 0);
     config.bpm_enable = (bool)deadbeef->conf_get_int("analysis.bpm_enable", 1);
+    config.meta_read_enable = (bool)deadbeef->conf_get_int("analysis.meta_read_enable", 1);
+    config.batch_write_tags = (bool)deadbeef->conf_get_int("analysis.batch_write_tags", 0);
+    config.prefetch_count = deadbeef->conf_get_int("analysis.prefetch_count", 2);
+    config.prefetch_threads = deadbeef->conf_get_int("analysis.prefetch_threads", 1);
+    config.live_enable = (bool)deadbeef->conf_get_int("analysis.live_enable", 1);
+    config.player_decoder_enable = (bool)deadbeef->conf_get_int("analysis.player_decoder_enable", 1);
+    config.progressive_enable = (bool)deadbeef->conf_get_int("analysis.progressive_enable", 1);
+    config.streaming_engine_enable = (bool)deadbeef->conf_get_int("analysis.streaming_engine_enable", 0);
+    config.memory_limit_mb = deadbeef->conf_get_int("analysis.memory_limit_mb", 0);
+    config.progressive_excerpt_length = deadbeef->conf_get_int("analysis.progressive_excerpt_length", 30);
+    config.debug_stats = (bool)deadbeef->conf_get_int("analysis.debug_stats", 0);
+    config.background_cpu_share = max(10, min(100, deadbeef->conf_get_int("analysis.background_cpu_share", 50)));
+    config.segmented_enable = (bool)deadbeef->conf_get_int("analysis.segmented_enable", 1);
+    config.segment_length = max(10, deadbeef->conf_get_int("analysis.segment_length", 30));
 }
 
 void set_config()
@@ -1100,19 +3678,38 @@ void set_config()
     deadbeef->conf_set_int("analysis.strength_length", config.strength_length);
     deadbeef->conf_set_int("analysis.chords_frame_size", config.chords_frame_size);
     deadbeef->conf_set_int("analysis.chords_hop_size", config.chords_hop_size);
+    deadbeef->conf_set_int("analysis.chords_threads", config.chords_threads);
+    deadbeef->conf_set_int("analysis.chords_native_hpcp", (int)config.chords_native_hpcp);
     deadbeef->conf_set_int("bpm_averaging", config.bpm_averaging);
     deadbeef->conf_set_float("analysis.circle_attenuration_speed", config.circle_attenuration_speed);
     deadbeef->conf_set_float("analysis.ChordsDetection_windowSize", config.ChordsDetection_windowSize);
     deadbeef->conf_set_int("analysis.chords_follow_the_rhythm", (int)config.chords_follow_the_rhythm);
     deadbeef->conf_set_int("analysis.chords_enable", (int)config.chords_enable);
     deadbeef->conf_set_int("analysis.key_enable", (int)config.key_enable);
+    deadbeef->conf_set_int("analysis.shared_spectrum_enable", (int)config.shared_spectrum_enable);
     deadbeef->conf_set_int("analysis.bpm_enable", (int)config.bpm_enable);
+    deadbeef->conf_set_int("analysis.meta_read_enable", (int)config.meta_read_enable);
+    deadbeef->conf_set_int("analysis.batch_write_tags", (int)config.batch_write_tags);
+    deadbeef->conf_set_int("analysis.prefetch_count", config.prefetch_count);
+    deadbeef->conf_set_int("analysis.prefetch_threads", config.prefetch_threads);
+    deadbeef->conf_set_int("analysis.live_enable", (int)config.live_enable);
+    deadbeef->conf_set_int("analysis.player_decoder_enable", (int)config.player_decoder_enable);
+    deadbeef->conf_set_int("analysis.progressive_enable", (int)config.progressive_enable);
+    deadbeef->conf_set_int("analysis.streaming_engine_enable", (int)config.streaming_engine_enable);
+    deadbeef->conf_set_int("analysis.memory_limit_mb", config.memory_limit_mb);
+    deadbeef->conf_set_int("analysis.progressive_excerpt_length", config.progressive_excerpt_length);
+    deadbeef->conf_set_int("analysis.debug_stats", (int)config.debug_stats);
+    deadbeef->conf_set_int("analysis.background_cpu_share", config.background_cpu_share);
+    deadbeef->conf_set_int("analysis.segmented_enable", (int)config.segmented_enable);
+    deadbeef->conf_set_int("analysis.segment_length", config.segment_length);
 }
 
 static int plugin_connect()
 {
     get_config();
+    cache_init(deadbeef->get_system_dir(DDB_SYS_DIR_CACHE));
     essentia::init();
+    scheduler_start();
     gtkui_plugin = (ddb_gtkui_t *)deadbeef->plug_get_for_id(DDB_GTKUI_PLUGIN_ID);
     if (gtkui_plugin)
     {
@@ -1129,6 +3726,15 @@ static int plugin_connect()
 static int plugin_disconnect()
 {
     set_config();
+    batch_stop();
+    live_stop();
+    scheduler_stop();
+    store.close();
+    if (audio_cache.track)
+    {
+        deadbeef->pl_item_unref(audio_cache.track);
+        audio_cache.track = nullptr;
+    }
     essentia::shutdown();
     gtkui_plugin = NULL;
     return 0;
@@ -1162,6 +3768,13 @@ void init_plugin()
     plugin.plugin.stop = plugin_stop;
     plugin.plugin.connect = plugin_connect;
     plugin.plugin.disconnect = plugin_disconnect;
+    plugin.plugin.get_actions = plugin_get_actions;
+
+    batch_action.title = "Analyze BPM, Key and Chords";
+    batch_action.name = "analysis_batch";
+    batch_action.flags = DB_ACTION_SINGLE_TRACK | DB_ACTION_MULTIPLE_TRACKS | DB_ACTION_ADD_MENU;
+    batch_action.callback2 = batch_action_callback;
+    batch_action.next = NULL;
 }
 
 extern "C" DB_plugin_t *ddb_analysis_GTK3_load(DB_functions_t *ddb)
@@ -0,0 +1,382 @@
+#include <cmath>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+#include "hpcp_kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HPCP_KERNEL_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HPCP_KERNEL_NEON
+#endif
+
+using namespace std;
+
+// the parameters analysis.cpp gives Essentia
+#define SAMPLE_RATE 44100.0f
+#define PEAKS_MAX_FREQUENCY 5000.0f
+#define PEAKS_MAX_COUNT 100
+#define HPCP_BINS 12
+#define HPCP_HARMONICS 4
+#define HPCP_MIN_FREQUENCY 40.0f
+#define HPCP_MAX_FREQUENCY 5000.0f
+#define HPCP_SPLIT_FREQUENCY 500.0f
+#define HPCP_REFERENCE_FREQUENCY 440.0f
+
+// FFTW planning isn't thread-safe, execution is
+static std::mutex plan_mutex;
+
+static void multiply_window_scalar(const float *frame, const float *window, float *out, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        out[i] = frame[i] * window[i];
+    }
+}
+
+static void magnitudes_scalar(const fftwf_complex *spectrum, float *out, int bins)
+{
+    for (int i = 0; i < bins; i++)
+    {
+        out[i] = sqrt(spectrum[i][0] * spectrum[i][0] + spectrum[i][1] * spectrum[i][1]);
+    }
+}
+
+#ifdef HPCP_KERNEL_X86
+__attribute__((target("avx2"))) static void multiply_window_avx2(const float *frame, const float *window, float *out, int size)
+{
+    int i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(frame + i), _mm256_loadu_ps(window + i)));
+    }
+    multiply_window_scalar(frame + i, window + i, out + i, size - i);
+}
+
+__attribute__((target("avx2"))) static void magnitudes_avx2(const fftwf_complex *spectrum, float *out, int bins)
+{
+    const float *in = (const float *)spectrum;
+    int i = 0;
+    for (; i + 8 <= bins; i += 8)
+    {
+        __m256 a = _mm256_loadu_ps(in + 2 * i);
+        __m256 b = _mm256_loadu_ps(in + 2 * i + 8);
+        // re^2 + im^2 pairs come out as 0 1 4 5 | 2 3 6 7
+        __m256 sums = _mm256_hadd_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b));
+        sums = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(sums), 0xd8));
+        _mm256_storeu_ps(out + i, _mm256_sqrt_ps(sums));
+    }
+    magnitudes_scalar(spectrum + i, out + i, bins - i);
+}
+#endif
+
+#ifdef HPCP_KERNEL_NEON
+static void multiply_window_neon(const float *frame, const float *window, float *out, int size)
+{
+    int i = 0;
+    for (; i + 4 <= size; i += 4)
+    {
+        vst1q_f32(out + i, vmulq_f32(vld1q_f32(frame + i), vld1q_f32(window + i)));
+    }
+    multiply_window_scalar(frame + i, window + i, out + i, size - i);
+}
+
+static void magnitudes_neon(const fftwf_complex *spectrum, float *out, int bins)
+{
+    const float *in = (const float *)spectrum;
+    int i = 0;
+    for (; i + 4 <= bins; i += 4)
+    {
+        float32x4x2_t c = vld2q_f32(in + 2 * i);
+        vst1q_f32(out + i, vsqrtq_f32(vmlaq_f32(vmulq_f32(c.val[0], c.val[0]), c.val[1], c.val[1])));
+    }
+    magnitudes_scalar(spectrum + i, out + i, bins - i);
+}
+#endif
+
+struct kernel_isa_t
+{
+    const char *name;
+    void (*multiply_window)(const float *, const float *, float *, int);
+    void (*magnitudes)(const fftwf_complex *, float *, int);
+};
+
+static const kernel_isa_t &kernel_isa()
+{
+    static const kernel_isa_t isa = []()
+    {
+#ifdef HPCP_KERNEL_X86
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return kernel_isa_t{"avx2", multiply_window_avx2, magnitudes_avx2};
+        }
+#endif
+#ifdef HPCP_KERNEL_NEON
+        return kernel_isa_t{"neon", multiply_window_neon, magnitudes_neon};
+#endif
+        return kernel_isa_t{"scalar", multiply_window_scalar, magnitudes_scalar};
+    }();
+    return isa;
+}
+
+const char *hpcp_kernel_isa()
+{
+    return kernel_isa().name;
+}
+
+struct harmonic_t
+{
+    float semitone;
+    float strength;
+};
+
+// pitch class offsets of the first harmonics folded into one octave, the
+// coinciding ones (octaves) summed up as in Essentia's HPCP
+static const vector<harmonic_t> &harmonics()
+{
+    static const vector<harmonic_t> table = []()
+    {
+        vector<harmonic_t> result;
+        for (int i = 0; i <= HPCP_HARMONICS; i++)
+        {
+            float semitone = 12.0 * log2(i + 1.0);
+            float octweight = max(1.0, (semitone / 12.0) * 0.5);
+            while (semitone >= 12.0 - 1e-5)
+            {
+                semitone -= 12.0;
+            }
+            auto it = find_if(result.begin(), result.end(), [&](const harmonic_t &h)
+                              { return h.semitone > semitone - 1e-5 && h.semitone < semitone + 1e-5; });
+            if (it == result.end())
+            {
+                result.push_back({semitone, (float)(1.0 / octweight)});
+            }
+            else
+            {
+                it->strength += 1.0 / octweight;
+            }
+        }
+        return result;
+    }();
+    return table;
+}
+
+hpcp_kernel_t::hpcp_kernel_t(int frame_size) : frame_size(frame_size), window(frame_size)
+{
+    // blackmanharris92, scaled to sum 2 like Essentia's normalized Windowing
+    double sum = 0.0;
+    for (int i = 0; i < frame_size; i++)
+    {
+        double x = 2.0 * M_PI * i / (frame_size - 1);
+        window[i] = 0.35875 - 0.48829 * cos(x) + 0.14128 * cos(2.0 * x) - 0.01168 * cos(3.0 * x);
+        sum += window[i];
+    }
+    for (float &w : window)
+    {
+        w *= 2.0 / sum;
+    }
+
+    int bins = frame_size / 2 + 1;
+    magnitudes.resize(bins);
+    peak_freqs.reserve(bins);
+    peak_mags.reserve(bins);
+
+    fft_in = (float *)fftwf_malloc(sizeof(float) * frame_size * HPCP_KERNEL_BLOCK);
+    fft_out = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * bins * HPCP_KERNEL_BLOCK);
+    {
+        lock_guard<std::mutex> lock(plan_mutex);
+        plan = fftwf_plan_many_dft_r2c(1, &frame_size, HPCP_KERNEL_BLOCK, fft_in, nullptr, 1, frame_size, fft_out, nullptr, 1, bins, FFTW_ESTIMATE | FFTW_DESTROY_INPUT);
+    }
+    if (!plan || !fft_in || !fft_out)
+    {
+        fftwf_free(fft_in);
+        fftwf_free(fft_out);
+        throw runtime_error("cannot create FFT plan");
+    }
+}
+
+hpcp_kernel_t::~hpcp_kernel_t()
+{
+    {
+        lock_guard<std::mutex> lock(plan_mutex);
+        fftwf_destroy_plan(plan);
+    }
+    fftwf_free(fft_in);
+    fftwf_free(fft_out);
+}
+
+// Essentia's PeakDetection on a magnitude spectrum: local maxima (plateaus
+// by their middle) refined by parabolic interpolation, up to maxFrequency,
+// the PEAKS_MAX_COUNT strongest kept and returned by frequency
+static void find_peaks(const vector<float> &spectrum, vector<float> &freqs, vector<float> &mags)
+{
+    freqs.clear();
+    mags.clear();
+    int size = spectrum.size();
+    float scale = (SAMPLE_RATE / 2.0f) / (size - 1);
+
+    int i = 0;
+    if (i + 1 < size && spectrum[i] > spectrum[i + 1] && spectrum[i] > 0.0f)
+    {
+        freqs.push_back(0.0f);
+        mags.push_back(spectrum[i]);
+    }
+    while (true)
+    {
+        while (i + 1 < size - 1 && spectrum[i] >= spectrum[i + 1])
+        {
+            i++;
+        }
+        while (i + 1 < size - 1 && spectrum[i] < spectrum[i + 1])
+        {
+            i++;
+        }
+        int j = i;
+        while (j + 1 < size - 1 && spectrum[j] == spectrum[j + 1])
+        {
+            j++;
+        }
+        if (j + 1 < size - 1 && spectrum[j + 1] < spectrum[j] && spectrum[j] > 0.0f)
+        {
+            float bin, value;
+            if (j != i)
+            {
+                bin = (i + j) * 0.5f;
+                value = spectrum[i];
+            }
+            else
+            {
+                float left = spectrum[j - 1], middle = spectrum[j], right = spectrum[j + 1];
+                float delta = 0.5f * (left - right) / (left - 2 * middle + right);
+                bin = j + delta;
+                value = middle - 0.25f * (left - right) * delta;
+            }
+            if (bin * scale > PEAKS_MAX_FREQUENCY)
+            {
+                break;
+            }
+            freqs.push_back(bin * scale);
+            mags.push_back(value);
+        }
+        i = j;
+        if (i + 1 >= size - 1)
+        {
+            break;
+        }
+    }
+
+    if ((int)freqs.size() > PEAKS_MAX_COUNT)
+    {
+        vector<int> order(freqs.size());
+        for (size_t k = 0; k < order.size(); k++)
+        {
+            order[k] = k;
+        }
+        stable_sort(order.begin(), order.end(), [&](int a, int b)
+                    { return mags[a] > mags[b]; });
+        order.resize(PEAKS_MAX_COUNT);
+        sort(order.begin(), order.end());
+        for (int k = 0; k < PEAKS_MAX_COUNT; k++)
+        {
+            freqs[k] = freqs[order[k]];
+            mags[k] = mags[order[k]];
+        }
+        freqs.resize(PEAKS_MAX_COUNT);
+        mags.resize(PEAKS_MAX_COUNT);
+    }
+}
+
+// squaredCosine weighting over a one semitone window
+static void add_contribution(float freq, float magnitude, float *hpcp)
+{
+    for (const harmonic_t &harmonic : harmonics())
+    {
+        float f = freq * pow(2.0, -harmonic.semitone / 12.0);
+        float bin = log2(f / HPCP_REFERENCE_FREQUENCY) * HPCP_BINS;
+        int left = ceil(bin - 0.5f);
+        int right = floor(bin + 0.5f);
+        for (int k = left; k <= right; k++)
+        {
+            float w = cos(M_PI * fabs(bin - k));
+            w *= w;
+            int wrapped = k % HPCP_BINS;
+            if (wrapped < 0)
+            {
+                wrapped += HPCP_BINS;
+            }
+            hpcp[wrapped] += w * (magnitude * magnitude) * harmonic.strength * harmonic.strength;
+        }
+    }
+}
+
+static void normalize_max(float *values)
+{
+    float top = *max_element(values, values + HPCP_BINS);
+    if (top != 0.0f)
+    {
+        for (int k = 0; k < HPCP_BINS; k++)
+        {
+            values[k] /= top;
+        }
+    }
+}
+
+static void compute_hpcp(const vector<float> &freqs, const vector<float> &mags, essentia::Real *out)
+{
+    float low[HPCP_BINS] = {0}, high[HPCP_BINS] = {0};
+    for (size_t k = 0; k < freqs.size(); k++)
+    {
+        if (freqs[k] >= HPCP_MIN_FREQUENCY && freqs[k] <= HPCP_MAX_FREQUENCY)
+        {
+            add_contribution(freqs[k], mags[k], freqs[k] < HPCP_SPLIT_FREQUENCY ? low : high);
+        }
+    }
+    normalize_max(low);
+    normalize_max(high);
+    for (int k = 0; k < HPCP_BINS; k++)
+    {
+        out[k] = low[k] + high[k];
+    }
+    normalize_max(out);
+
+    for (int k = 0; k < HPCP_BINS; k++)
+    {
+        float v = sin(out[k] * M_PI * 0.5);
+        v *= v;
+        if (v < 0.6f)
+        {
+            v *= v / 0.6f * v / 0.6f;
+        }
+        out[k] = v;
+    }
+}
+
+void hpcp_kernel_t::compute(const vector<essentia::Real> *frames, size_t count, essentia::Real *out)
+{
+    const kernel_isa_t &isa = kernel_isa();
+    int bins = frame_size / 2 + 1;
+    if (count > HPCP_KERNEL_BLOCK)
+    {
+        throw runtime_error("too many frames for one block");
+    }
+
+    // the zero-phase rotation Essentia applies doesn't change magnitudes
+    for (size_t f = 0; f < count; f++)
+    {
+        if ((int)frames[f].size() != frame_size)
+        {
+            throw runtime_error("unexpected frame size");
+        }
+        isa.multiply_window(frames[f].data(), window.data(), fft_in + f * frame_size, frame_size);
+    }
+    fftwf_execute(plan);
+
+    for (size_t f = 0; f < count; f++)
+    {
+        isa.magnitudes(fft_out + f * bins, magnitudes.data(), bins);
+        find_peaks(magnitudes, peak_freqs, peak_mags);
+        compute_hpcp(peak_freqs, peak_mags, out + f * HPCP_BINS);
+    }
+}
@@ -0,0 +1,46 @@
+// Native chroma kernel, an optional fast path for the chord pipeline.
+//
+// Computes for a block of frames what analysis.cpp gets from Essentia's
+// Windowing("blackmanharris92") -> Spectrum -> SpectralPeaks -> HPCP with the
+// same parameters (12 bins, 4 harmonics, squaredCosine, bandPreset, unitMax,
+// nonLinear), with one batched FFTW plan per block and AVX2/NEON windowing and
+// magnitudes picked at runtime.
+//
+// Tolerance: the FFT backend and the summation order differ from Essentia's,
+// so bins may differ by up to HPCP_KERNEL_TOLERANCE (absolute, on the unitMax
+// normalized output). `ddb_analysis_bench -k` reports the actual deviation.
+#ifndef DDB_HPCP_KERNEL_H
+#define DDB_HPCP_KERNEL_H
+
+#include <cstddef>
+#include <vector>
+#include <fftw3.h>
+#include <essentia/essentia.h>
+
+#define HPCP_KERNEL_TOLERANCE 1e-3f
+#define HPCP_KERNEL_BLOCK 16
+
+struct hpcp_kernel_t
+{
+    int frame_size;
+    std::vector<float> window;
+    float *fft_in;
+    fftwf_complex *fft_out;
+    fftwf_plan plan;
+    std::vector<float> magnitudes;
+    std::vector<float> peak_freqs, peak_mags;
+
+    explicit hpcp_kernel_t(int frame_size);
+    ~hpcp_kernel_t();
+    hpcp_kernel_t(const hpcp_kernel_t &) = delete;
+    hpcp_kernel_t &operator=(const hpcp_kernel_t &) = delete;
+
+    // frames[0..count) hold frame_size samples each, count <= HPCP_KERNEL_BLOCK;
+    // writes count rows of 12 values to out
+    void compute(const std::vector<essentia::Real> *frames, size_t count, essentia::Real *out);
+};
+
+// "avx2", "neon" or "scalar", whichever compute() uses on this CPU
+const char *hpcp_kernel_isa();
+
+#endif